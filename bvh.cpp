@@ -15,24 +15,133 @@ bvh::bvh(Mesh* m) {
 	dataCollector = new DataCollector();
 }
 
-void bvh::Build(bool isQ) {
+bvh::~bvh() {
+	// a rebuild still in flight must finish before its thread object goes
+	if (builder == nullptr) return;
+	if (buildThread.joinable()) buildThread.join();
+	delete[] builder->bvhNode;
+	delete[] builder->primitiveIdx;
+	delete builder->dataCollector;
+	delete builder;
+}
+
+void bvh::CountPrimitives() {
+	discs.clear();
+	meshFirst.clear();
 	if (scene != nullptr) {
-		NTri = scene->getTriangleNb();
+		NTri = topLevel ? 0 : scene->getTriangleNb();
+		// first scene-wide triangle of each mesh, and enough bits for the
+		// largest mesh's faces: packed triangle references hold both
+		uint maxFaces = 1;
+		for (uint i = 0, first = 0; i < (topLevel ? 0 : size(scene->meshes)); i++) {
+			meshFirst.push_back(first);
+			first += scene->meshes[i].getSize();
+			maxFaces = max(maxFaces, (uint)scene->meshes[i].getSize());
+		}
+		faceBits = 1;
+		while (faceBits < PRIM_TYPE_SHIFT && (1u << faceBits) < maxFaces) faceBits++;
+		FATALERROR_IF(size(scene->meshes) > (1ull << (PRIM_TYPE_SHIFT - faceBits)), "too many meshes for the triangle references");
 		NSph = size(scene->spheres);
-		NPla = size(scene->planes);
+		NCub = size(scene->cubes);
+		// area lights are emissive discs; other lights have no surface
+		for (Light* light : scene->lights)
+			if (AreaLight* disc = dynamic_cast<AreaLight*>(light)) discs.push_back(disc);
+		NDisc = size(discs);
+		// unbounded: tested before traversal, never part of the tree
+		if (!topLevel) planes.Set(scene->planes);
 	}else if (mesh != nullptr) {
 		NTri = size(mesh->faces);
-		NSph = 0;
-		NPla = 0;
+		NSph = NCub = NDisc = 0;
+		faceBits = PRIM_TYPE_SHIFT;
 	}
+	// global index order
+	typeBase[PRIM_TRIANGLE] = 0;
+	typeBase[PRIM_SPHERE] = NTri;
+	typeBase[PRIM_CUBE] = NTri + NSph;
+	typeBase[PRIM_DISC] = NTri + NSph + NCub;
+	N = NTri + NSph + NCub + NDisc;
+}
+
+void bvh::Build(bool isQ) {
+	CountPrimitives();
 	cout << "#Tri : " << NTri << endl;
 	cout << "#Sph : " << NSph << endl;
-	cout << "#Pla : " << NPla << endl;
-	N = NTri + NSph + NPla;
-	primitiveIdx = new uint[N];
-	bvhNode = new BVHNode[2 * (N + 1) - 1];
+	cout << "#Cub : " << NCub << endl;
+	cout << "#Disc : " << NDisc << endl;
+	cout << "#Pla : " << planes.count << " (outside the BVH)" << endl;
 	isQBVH = isQ;
 	Timer t;
+	GatherBuildInput();
+	Construct();
+	BuildSphereCloud();
+	printf("BVH Build time : %5.2f ms \n", t.elapsed() * 1000);
+	dataCollector->UpdateBuildTime(t.elapsed() * 1000);
+	t.reset();
+	LinkParents();
+	Refit();
+	printf("BVH Refit time : %5.2f ms \n", t.elapsed() * 1000);
+	buildCost = SAHCost();
+	dataCollector->UpdateNodeCount(nodesUsed);
+}
+
+// snapshot the per-primitive bounds and centroids; the tree construction
+// only reads this snapshot, so it can run while the geometry moves on
+void bvh::GatherBuildInput() {
+	centroid = new float3[N];
+	primBounds = new aabb[N];
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < (int)N; ++i) {
+		uint type = TypeOf(i), idx = i - typeBase[type];
+		aabb& box = primBounds[i];
+		box = aabb();
+		switch (type) {
+			case PRIM_TRIANGLE: {
+				float3 v0, v1, v2;
+				LocateTriangle(idx).GetFace(idx, v0, v1, v2);
+				box.grow(v0);
+				box.grow(v1);
+				box.grow(v2);
+				break;
+			}
+			case PRIM_SPHERE: {
+				Sphere& sphere = scene->spheres[idx];
+				box.grow(sphere.pos - float3(sphere.r));
+				box.grow(sphere.pos + float3(sphere.r));
+				break;
+			}
+			case PRIM_CUBE:
+				scene->cubes[idx].Bounds(box.bmin, box.bmax);
+				break;
+			case PRIM_DISC:
+				discs[idx]->Bounds(box.bmin, box.bmax);
+				break;
+		}
+		centroid[i] = (box.bmin + box.bmax) * 0.5f;
+	}
+}
+
+void bvh::Construct() {
+	if (N == 0) {
+		// nothing to subdivide (e.g. planes only): a lone empty root whose
+		// box stays inverted; traversal never reaches it, see Intersect
+		primitiveIdx = nullptr;
+		bvhNode = new BVHNode[1];
+		bvhNode[rootNodeIdx].aabbMin = float3(1e30f);
+		bvhNode[rootNodeIdx].aabbMax = float3(-1e30f);
+		bvhNode[rootNodeIdx].primCount = 0;
+		bvhNode[rootNodeIdx].leftFirst = 1;
+		nodesUsed = 1;
+		delete[] centroid;
+		delete[] primBounds;
+		centroid = nullptr;
+		primBounds = nullptr;
+		bounds = aabb();
+		return;
+	}
+	primitiveIdx = new uint[N];
+	// a QBVH split takes four slots even when it makes fewer children
+	bvhNode = new BVHNode[isQBVH ? 4 * N + 2 : 2 * (N + 1) - 1];
+	nodesUsed = 2;
 	for (uint i = 0; i < N; ++i) {
 		primitiveIdx[i] = i;
 	}
@@ -42,74 +151,86 @@ void bvh::Build(bool isQ) {
 	root.leftFirst = 0;
 
 	UpdateNodeBounds(rootNodeIdx);
-	cout << "Subdivison star" << endl;
 	if (isQBVH) QSubdivide(rootNodeIdx);
-	else separatePlanes(rootNodeIdx);
+	else Subdivide(rootNodeIdx);
+	PackPrimRefs();
+	delete[] centroid;
+	delete[] primBounds;
+	centroid = nullptr;
+	primBounds = nullptr;
+	bounds = aabb();
 	bounds.grow(root.aabbMin);
 	bounds.grow(root.aabbMax);
-	printf("BVH Build time : %5.2f ms \n", t.elapsed() * 1000);
-	dataCollector->UpdateBuildTime(t.elapsed() * 1000);
-	t.reset();
-	Refit();
-	printf("BVH Refit time : %5.2f ms \n", t.elapsed() * 1000);
-	dataCollector->UpdateNodeCount(nodesUsed);
 }
 
-Triangle bvh::getTriangle(uint idx) {
-	if (scene != nullptr) {
-		return scene->getTriangle(idx);
-	}
-	else if (mesh != nullptr) {
-		return mesh->tri[idx];
-	}
+const Mesh& bvh::TriMesh(uint& idx) const {
+	// packed triangle reference to mesh and face: no search in the hot path
+	if (mesh != nullptr) return *mesh;
+	const Mesh& m = scene->meshes[idx >> faceBits];
+	idx &= (1u << faceBits) - 1;
+	return m;
+}
+
+const Mesh& bvh::LocateTriangle(uint& idx) const {
+	// build time: scene-wide triangle index to mesh and face
+	if (mesh != nullptr) return *mesh;
+	uint m = (uint)(upper_bound(meshFirst.begin(), meshFirst.end(), idx) - meshFirst.begin()) - 1;
+	idx -= meshFirst[m];
+	return scene->meshes[m];
 }
 
 void bvh::UpdateNodeBounds(uint nodeIdx) {
+	// build time: bounds come from the snapshot
+	BVHNode& node = bvhNode[nodeIdx];
+	aabb box;
+	for (uint first = node.leftFirst, i = 0; i < node.primCount; i++)
+		box.grow(primBounds[primitiveIdx[first + i]]);
+	node.aabbMin = box.bmin;
+	node.aabbMax = box.bmax;
+	dataCollector->UpdateSummedArea(node.aabbMin, node.aabbMax);
+}
+
+void bvh::RefitLeaf(uint nodeIdx) {
+	// refit time: bounds come from the live geometry; leaves hold one type
 	BVHNode& node = bvhNode[nodeIdx];
 	node.aabbMin = float3(1e30f);
 	node.aabbMax = float3(-1e30f);
-	for (uint first = node.leftFirst, i = 0; i < node.primCount; i++) {
-		uint leafIdx = primitiveIdx[first + i];
-
-		if (leafIdx < NTri ) {
-			Triangle& leafTri = getTriangle(leafIdx);
-			node.aabbMin = fminf(node.aabbMin, leafTri.v0);
-			node.aabbMin = fminf(node.aabbMin, leafTri.v1);
-			node.aabbMin = fminf(node.aabbMin, leafTri.v2);
-			node.aabbMax = fmaxf(node.aabbMax, leafTri.v0);
-			node.aabbMax = fmaxf(node.aabbMax, leafTri.v1);
-			node.aabbMax = fmaxf(node.aabbMax, leafTri.v2);
-			dataCollector->UpdateSummedArea(node.aabbMin, node.aabbMax);
-		} else if (leafIdx >= NTri && leafIdx< NTri+NSph){
-			leafIdx -= NTri;
-			Sphere& leafSph = scene->spheres[leafIdx];
-			node.aabbMin = fminf(node.aabbMin, leafSph.pos - float3(leafSph.r));
-			node.aabbMax = fmaxf(node.aabbMax, leafSph.pos + float3(leafSph.r));
-			dataCollector->UpdateSummedArea(node.aabbMin, node.aabbMax);
-		}
-		else {
-			leafIdx -= NTri + NSph;
-			Plane& leafPla = scene->planes[leafIdx];
-			float3 normal = normalize(leafPla.N);
-			if (normal.x + normal.y + normal.z == 1 && (normal.x == 1 || normal.y == 1 || normal.z == 1)) {
-				if (normal.x == 1) {
-					node.aabbMin = fminf(node.aabbMin, float3(0, -1e30f, -1e30f));
-					node.aabbMax = fmaxf(node.aabbMax, float3(0, 1e30f, 1e30f));
-				} else
-				if (normal.y == 1) {
-					node.aabbMin = fminf(node.aabbMin, float3(-1e30f, 0, -1e30f));
-					node.aabbMax = fmaxf(node.aabbMax, float3(1e30f, 0, 1e30f));
-				} else
-				if (normal.z == 1) {
-					node.aabbMin = fminf(node.aabbMin, float3(-1e30f, -1e30f, 0));
-					node.aabbMax = fmaxf(node.aabbMax, float3(1e30f, 1e30f, 0));
-				}
-			} else{
-				node.aabbMin = float3(-1e30f);
-				node.aabbMax = float3(1e30f);
-				return;
+	const uint* ref = primitiveIdx + node.leftFirst;
+	switch (PrimType(ref[0])) {
+		case PRIM_TRIANGLE:
+			for (uint i = 0; i < node.primCount; i++) {
+				uint triIdx = PrimIndex(ref[i]);
+				float3 v0, v1, v2;
+				TriMesh(triIdx).GetFace(triIdx, v0, v1, v2);
+				node.aabbMin = fminf(node.aabbMin, fminf(v0, fminf(v1, v2)));
+				node.aabbMax = fmaxf(node.aabbMax, fmaxf(v0, fmaxf(v1, v2)));
 			}
-		}
+			break;
+		case PRIM_SPHERE:
+			for (uint i = 0; i < node.primCount; i++) {
+				uint slot = PrimIndex(ref[i]);
+				Sphere& sphere = scene->spheres[sphereCloud.source[slot]];
+				sphereCloud.Set(slot, sphere);
+				node.aabbMin = fminf(node.aabbMin, sphere.pos - float3(sphere.r));
+				node.aabbMax = fmaxf(node.aabbMax, sphere.pos + float3(sphere.r));
+			}
+			break;
+		case PRIM_CUBE:
+			for (uint i = 0; i < node.primCount; i++) {
+				float3 bmin, bmax;
+				scene->cubes[PrimIndex(ref[i])].Bounds(bmin, bmax);
+				node.aabbMin = fminf(node.aabbMin, bmin);
+				node.aabbMax = fmaxf(node.aabbMax, bmax);
+			}
+			break;
+		case PRIM_DISC:
+			for (uint i = 0; i < node.primCount; i++) {
+				float3 bmin, bmax;
+				discs[PrimIndex(ref[i])]->Bounds(bmin, bmax);
+				node.aabbMin = fminf(node.aabbMin, bmin);
+				node.aabbMax = fmaxf(node.aabbMax, bmax);
+			}
+			break;
 	}
 }
 
@@ -123,17 +244,8 @@ float bvh::FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
 		for (int i = 0; i < node.primCount; i++)
 		{
 			uint primIdx = primitiveIdx[node.leftFirst + i];
-			if (primIdx < NTri) {
-				Triangle& triangle = getTriangle(primIdx);
-				boundsMin = min(boundsMin, triangle.centroid[a]);
-				boundsMax = max(boundsMax, triangle.centroid[a]);
-			}else if (primIdx >= NTri && primIdx < NTri + NSph) {
-				primIdx -= NTri;
-				Sphere& sphere = scene->spheres[primIdx];
-				boundsMin = min(boundsMin, sphere.pos[a]);
-				boundsMax = max(boundsMax, sphere.pos[a]);
-			}
-
+			boundsMin = min(boundsMin, centroid[primIdx][a]);
+			boundsMax = max(boundsMax, centroid[primIdx][a]);
 		}
 		if (boundsMin == boundsMax) continue;
 		// populate the bins
@@ -142,24 +254,10 @@ float bvh::FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
 		for (uint i = 0; i < node.primCount; i++)
 		{
 			uint primIdx = primitiveIdx[node.leftFirst + i];
-			int binIdx; 
-			if (primIdx < NTri) {
-				Triangle& triangle = getTriangle(primIdx);
-				binIdx = min(BINS - 1,
-					(int)((triangle.centroid[a] - boundsMin) * scale));
-				bin[binIdx].primCount++;
-				bin[binIdx].bounds.grow(triangle.v0);
-				bin[binIdx].bounds.grow(triangle.v1);
-				bin[binIdx].bounds.grow(triangle.v2);
-			} else if (primIdx >= NTri && primIdx < NTri + NSph) {
-				primIdx -= NTri;
-				Sphere& sphere = scene->spheres[primIdx];
-				binIdx = min(BINS - 1,
-					(int)((sphere.pos[a] - boundsMin) * scale));
-				bin[binIdx].primCount++;
-				bin[binIdx].bounds.grow(sphere.pos - float3(2*sphere.r));
-				bin[binIdx].bounds.grow(sphere.pos + float3(2*sphere.r));
-			}
+			int binIdx = min(BINS - 1,
+				(int)((centroid[primIdx][a] - boundsMin) * scale));
+			bin[binIdx].primCount++;
+			bin[binIdx].bounds.grow(primBounds[primIdx]);
 		}
 		
 		float leftArea[BINS - 1], rightArea[BINS - 1];
@@ -199,25 +297,250 @@ float bvh::CalculateNodeCost(BVHNode& node) {
 	return node.primCount * surfaceArea;
 }
 
-void bvh::separatePlanes(uint nodeIdx) {
-	BVHNode& node = bvhNode[nodeIdx];
-	if (NPla > 0 && (NSph + NTri > 0)) {
-		// create child nodes
-		int leftChildIdx = nodesUsed++;
-		int rightChildIdx = nodesUsed++;
-		bvhNode[leftChildIdx].leftFirst = 0;
-		bvhNode[leftChildIdx].primCount = NTri + NSph;
-		bvhNode[rightChildIdx].leftFirst = NTri + NSph;
-		bvhNode[rightChildIdx].primCount = NPla;
-		node.leftFirst = leftChildIdx;
-		node.primCount = 0;
-		UpdateNodeBounds(leftChildIdx);
-		UpdateNodeBounds(rightChildIdx);
-		// recurse
-		Subdivide(leftChildIdx);
-	} else {
-		Subdivide(nodeIdx);
+uint bvh::TypeOf(uint primIdx) const {
+	// build-time indices are global, in the order set up by CountPrimitives
+	if (primIdx < typeBase[PRIM_SPHERE]) return PRIM_TRIANGLE;
+	if (primIdx < typeBase[PRIM_CUBE]) return PRIM_SPHERE;
+	if (primIdx < typeBase[PRIM_DISC]) return PRIM_CUBE;
+	return PRIM_DISC;
+}
+
+bool bvh::IsMixed(BVHNode& node) const {
+	uint type = TypeOf(primitiveIdx[node.leftFirst]);
+	for (uint i = 1; i < node.primCount; i++)
+		if (TypeOf(primitiveIdx[node.leftFirst + i]) != type) return true;
+	return false;
+}
+
+int bvh::PartitionByType(BVHNode& node) {
+	// primitives of the first one's type to the left, the rest to the right
+	uint type = TypeOf(primitiveIdx[node.leftFirst]);
+	int i = node.leftFirst;
+	int j = i + node.primCount - 1;
+	while (i <= j)
+	{
+		if (TypeOf(primitiveIdx[i]) == type)
+			i++;
+		else
+			swap(primitiveIdx[i], primitiveIdx[j--]);
+	}
+	return i;
+}
+
+void bvh::PackPrimRefs() {
+	// after the build: global indices become (type, index within type)
+	// triangles keep their mesh in the bits above faceBits, see TriMesh
+	for (uint i = 0; i < N; i++) {
+		uint type = TypeOf(primitiveIdx[i]), idx = primitiveIdx[i] - typeBase[type];
+		if (type == PRIM_TRIANGLE && mesh == nullptr) {
+			uint m = (uint)(upper_bound(meshFirst.begin(), meshFirst.end(), idx) - meshFirst.begin()) - 1;
+			idx = (m << faceBits) | (idx - meshFirst[m]);
+		}
+		primitiveIdx[i] = MakePrimRef(type, idx);
+	}
+}
+
+uint bvh::GlobalIndex(uint ref) const {
+	uint type = PrimType(ref), idx = PrimIndex(ref);
+	if (type == PRIM_SPHERE) idx = sphereCloud.source[idx];
+	if (type == PRIM_TRIANGLE && mesh == nullptr) idx = meshFirst[idx >> faceBits] + (idx & ((1u << faceBits) - 1));
+	return typeBase[type] + idx;
+}
+
+void bvh::BuildSphereCloud() {
+	// copy the spheres out in primitiveIdx order, so every sphere leaf is a
+	// contiguous SoA range, and point the references at their slots
+	sphereCloud.Clear();
+	if (NSph == 0) return;
+	uint slots = 0;
+	for (uint i = 0; i < N; i++) {
+		if (PrimType(primitiveIdx[i]) != PRIM_SPHERE) continue;
+		const Sphere& sphere = scene->spheres[PrimIndex(primitiveIdx[i])];
+		sphereCloud.source.push_back(PrimIndex(primitiveIdx[i]));
+		sphereCloud.matId.push_back(sphere.mat->id);
+		primitiveIdx[i] = MakePrimRef(PRIM_SPHERE, slots++);
+	}
+	// padding: the last leaf may load a whole SIMD group past its end
+	for (vector<float>* a : { &sphereCloud.cx, &sphereCloud.cy, &sphereCloud.cz, &sphereCloud.r2, &sphereCloud.invr })
+		a->assign(slots + SPHERE_LANES - 1, 0);
+	sphereCloud.objIdx.assign(slots, -1);
+	for (uint i = 0; i < slots; i++) sphereCloud.Set(i, scene->spheres[sphereCloud.source[i]]);
+}
+
+void SphereCloud::Clear() {
+	cx.clear(), cy.clear(), cz.clear(), r2.clear(), invr.clear();
+	objIdx.clear(), matId.clear(), source.clear();
+}
+
+void SphereCloud::Set(uint slot, const Sphere& sphere) {
+	cx[slot] = sphere.pos.x, cy[slot] = sphere.pos.y, cz[slot] = sphere.pos.z;
+	r2[slot] = sphere.r2, invr[slot] = sphere.invr;
+	objIdx[slot] = sphere.objIdx;
+}
+
+#ifdef __AVX__
+// Release builds target AVX2: eight spheres per iteration
+void SphereCloud::Intersect(uint first, uint count, Ray& ray, float t_min) const {
+	// same quadratic as Sphere::Intersect
+	const __m256 Ox = _mm256_set1_ps(ray.O.x), Oy = _mm256_set1_ps(ray.O.y), Oz = _mm256_set1_ps(ray.O.z);
+	const __m256 Dx = _mm256_set1_ps(ray.D.x), Dy = _mm256_set1_ps(ray.D.y), Dz = _mm256_set1_ps(ray.D.z);
+	const __m256 tmin8 = _mm256_set1_ps(t_min), zero8 = _mm256_setzero_ps();
+	int best = -1;
+	for (uint i = 0; i < count; i += 8) {
+		const uint k = first + i;
+		__m256 ocx = _mm256_sub_ps(Ox, _mm256_loadu_ps(&cx[k]));
+		__m256 ocy = _mm256_sub_ps(Oy, _mm256_loadu_ps(&cy[k]));
+		__m256 ocz = _mm256_sub_ps(Oz, _mm256_loadu_ps(&cz[k]));
+		__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, Dx), _mm256_mul_ps(ocy, Dy)), _mm256_mul_ps(ocz, Dz));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&r2[k]));
+		__m256 d = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+		__m256 valid = _mm256_cmp_ps(d, zero8, _CMP_GT_OQ);
+		d = _mm256_sqrt_ps(_mm256_max_ps(d, zero8));
+		__m256 t8 = _mm256_set1_ps(ray.t);
+		// near root if it is in range, far root otherwise
+		__m256 tNear = _mm256_sub_ps(_mm256_sub_ps(zero8, b), d), tFar = _mm256_sub_ps(d, b);
+		__m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(tNear, tmin8, _CMP_GT_OQ), _mm256_cmp_ps(tNear, t8, _CMP_LT_OQ));
+		__m256 t = _mm256_blendv_ps(tFar, tNear, nearOk);
+		__m256 hit = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, tmin8, _CMP_GT_OQ), _mm256_cmp_ps(t, t8, _CMP_LT_OQ)));
+		int mask = _mm256_movemask_ps(hit) & ((1 << min(8u, count - i)) - 1);
+		if (!mask) continue;
+		float tl[8];
+		_mm256_storeu_ps(tl, t);
+		for (int j = 0; j < 8; j++) if ((mask & (1 << j)) && tl[j] < ray.t) ray.t = tl[j], best = k + j;
+	}
+	if (best == -1) return;
+	ray.objIdx = objIdx[best], ray.matId = matId[best];
+	ray.SetNormal((ray.IntersectionPoint() - float3(cx[best], cy[best], cz[best])) * invr[best]);
+}
+
+bool SphereCloud::IsOccluding(uint first, uint count, const Ray& ray, float t_min) const {
+	const __m256 Ox = _mm256_set1_ps(ray.O.x), Oy = _mm256_set1_ps(ray.O.y), Oz = _mm256_set1_ps(ray.O.z);
+	const __m256 Dx = _mm256_set1_ps(ray.D.x), Dy = _mm256_set1_ps(ray.D.y), Dz = _mm256_set1_ps(ray.D.z);
+	const __m256 tmin8 = _mm256_set1_ps(t_min), t8 = _mm256_set1_ps(ray.t), zero8 = _mm256_setzero_ps();
+	for (uint i = 0; i < count; i += 8) {
+		const uint k = first + i;
+		__m256 ocx = _mm256_sub_ps(Ox, _mm256_loadu_ps(&cx[k]));
+		__m256 ocy = _mm256_sub_ps(Oy, _mm256_loadu_ps(&cy[k]));
+		__m256 ocz = _mm256_sub_ps(Oz, _mm256_loadu_ps(&cz[k]));
+		__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, Dx), _mm256_mul_ps(ocy, Dy)), _mm256_mul_ps(ocz, Dz));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&r2[k]));
+		__m256 d = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+		__m256 valid = _mm256_cmp_ps(d, zero8, _CMP_GT_OQ);
+		d = _mm256_sqrt_ps(_mm256_max_ps(d, zero8));
+		__m256 tNear = _mm256_sub_ps(_mm256_sub_ps(zero8, b), d), tFar = _mm256_sub_ps(d, b);
+		__m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(tNear, tmin8, _CMP_GT_OQ), _mm256_cmp_ps(tNear, t8, _CMP_LT_OQ));
+		__m256 farOk = _mm256_and_ps(_mm256_cmp_ps(tFar, tmin8, _CMP_GT_OQ), _mm256_cmp_ps(tFar, t8, _CMP_LT_OQ));
+		int mask = _mm256_movemask_ps(_mm256_and_ps(valid, _mm256_or_ps(nearOk, farOk)));
+		if (mask & ((1 << min(8u, count - i)) - 1)) return true;
+	}
+	return false;
+}
+#else
+// SSE fallback (the Debug configuration): four spheres per iteration
+void SphereCloud::Intersect(uint first, uint count, Ray& ray, float t_min) const {
+	// same quadratic as Sphere::Intersect
+	const __m128 Ox = _mm_set1_ps(ray.O.x), Oy = _mm_set1_ps(ray.O.y), Oz = _mm_set1_ps(ray.O.z);
+	const __m128 Dx = _mm_set1_ps(ray.D.x), Dy = _mm_set1_ps(ray.D.y), Dz = _mm_set1_ps(ray.D.z);
+	const __m128 tmin4 = _mm_set1_ps(t_min), zero4 = _mm_setzero_ps();
+	int best = -1;
+	for (uint i = 0; i < count; i += 4) {
+		const uint k = first + i;
+		__m128 ocx = _mm_sub_ps(Ox, _mm_loadu_ps(&cx[k]));
+		__m128 ocy = _mm_sub_ps(Oy, _mm_loadu_ps(&cy[k]));
+		__m128 ocz = _mm_sub_ps(Oz, _mm_loadu_ps(&cz[k]));
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, Dx), _mm_mul_ps(ocy, Dy)), _mm_mul_ps(ocz, Dz));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&r2[k]));
+		__m128 d = _mm_sub_ps(_mm_mul_ps(b, b), c);
+		__m128 valid = _mm_cmpgt_ps(d, zero4);
+		d = _mm_sqrt_ps(_mm_max_ps(d, zero4));
+		__m128 t4 = _mm_set1_ps(ray.t);
+		// near root if it is in range, far root otherwise
+		__m128 tNear = _mm_sub_ps(_mm_sub_ps(zero4, b), d), tFar = _mm_sub_ps(d, b);
+		__m128 nearOk = _mm_and_ps(_mm_cmpgt_ps(tNear, tmin4), _mm_cmplt_ps(tNear, t4));
+		__m128 t = _mm_or_ps(_mm_and_ps(nearOk, tNear), _mm_andnot_ps(nearOk, tFar));
+		__m128 hit = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, tmin4), _mm_cmplt_ps(t, t4)));
+		int mask = _mm_movemask_ps(hit) & ((1 << min(4u, count - i)) - 1);
+		if (!mask) continue;
+		float tl[4];
+		_mm_storeu_ps(tl, t);
+		for (int j = 0; j < 4; j++) if ((mask & (1 << j)) && tl[j] < ray.t) ray.t = tl[j], best = k + j;
+	}
+	if (best == -1) return;
+	ray.objIdx = objIdx[best], ray.matId = matId[best];
+	ray.SetNormal((ray.IntersectionPoint() - float3(cx[best], cy[best], cz[best])) * invr[best]);
+}
+
+bool SphereCloud::IsOccluding(uint first, uint count, const Ray& ray, float t_min) const {
+	const __m128 Ox = _mm_set1_ps(ray.O.x), Oy = _mm_set1_ps(ray.O.y), Oz = _mm_set1_ps(ray.O.z);
+	const __m128 Dx = _mm_set1_ps(ray.D.x), Dy = _mm_set1_ps(ray.D.y), Dz = _mm_set1_ps(ray.D.z);
+	const __m128 tmin4 = _mm_set1_ps(t_min), t4 = _mm_set1_ps(ray.t), zero4 = _mm_setzero_ps();
+	for (uint i = 0; i < count; i += 4) {
+		const uint k = first + i;
+		__m128 ocx = _mm_sub_ps(Ox, _mm_loadu_ps(&cx[k]));
+		__m128 ocy = _mm_sub_ps(Oy, _mm_loadu_ps(&cy[k]));
+		__m128 ocz = _mm_sub_ps(Oz, _mm_loadu_ps(&cz[k]));
+		__m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, Dx), _mm_mul_ps(ocy, Dy)), _mm_mul_ps(ocz, Dz));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&r2[k]));
+		__m128 d = _mm_sub_ps(_mm_mul_ps(b, b), c);
+		__m128 valid = _mm_cmpgt_ps(d, zero4);
+		d = _mm_sqrt_ps(_mm_max_ps(d, zero4));
+		__m128 tNear = _mm_sub_ps(_mm_sub_ps(zero4, b), d), tFar = _mm_sub_ps(d, b);
+		__m128 nearOk = _mm_and_ps(_mm_cmpgt_ps(tNear, tmin4), _mm_cmplt_ps(tNear, t4));
+		__m128 farOk = _mm_and_ps(_mm_cmpgt_ps(tFar, tmin4), _mm_cmplt_ps(tFar, t4));
+		int mask = _mm_movemask_ps(_mm_and_ps(valid, _mm_or_ps(nearOk, farOk)));
+		if (mask & ((1 << min(4u, count - i)) - 1)) return true;
 	}
+	return false;
+}
+#endif
+
+void PlaneList::Set(const vector<Plane>& planes) {
+	// SoA, padded to whole groups of four with planes that are never hit
+	count = (uint)planes.size();
+	uint padded = (count + 3) & ~3u;
+	nx.assign(padded, 0), ny.assign(padded, 0), nz.assign(padded, 0), d.assign(padded, 0);
+	objIdx.assign(count, -1), matId.assign(count, 0);
+	for (uint i = 0; i < count; i++) {
+		nx[i] = planes[i].N.x, ny[i] = planes[i].N.y, nz[i] = planes[i].N.z, d[i] = planes[i].d;
+		objIdx[i] = planes[i].objIdx, matId[i] = planes[i].mat->id;
+	}
+}
+
+void PlaneList::Distances(uint i, const Ray& ray, __m128& t) const {
+	// t = -(O.N + d) / (D.N), four planes at once; padding gives 0/0
+	__m128 ON = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ray.O.x), _mm_loadu_ps(&nx[i])),
+		_mm_mul_ps(_mm_set1_ps(ray.O.y), _mm_loadu_ps(&ny[i]))), _mm_mul_ps(_mm_set1_ps(ray.O.z), _mm_loadu_ps(&nz[i])));
+	__m128 DN = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(ray.D.x), _mm_loadu_ps(&nx[i])),
+		_mm_mul_ps(_mm_set1_ps(ray.D.y), _mm_loadu_ps(&ny[i]))), _mm_mul_ps(_mm_set1_ps(ray.D.z), _mm_loadu_ps(&nz[i])));
+	t = _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(ON, _mm_loadu_ps(&d[i]))), DN);
+}
+
+void PlaneList::Intersect(Ray& ray, float t_min) const {
+	int best = -1;
+	for (uint i = 0; i < count; i += 4) {
+		__m128 t;
+		Distances(i, ray, t);
+		// NaN lanes (padding) fail both compares
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(t_min)), _mm_cmplt_ps(t, _mm_set1_ps(ray.t)));
+		int mask = _mm_movemask_ps(hit);
+		if (!mask) continue;
+		float tl[4];
+		_mm_storeu_ps(tl, t);
+		for (int j = 0; j < 4; j++) if ((mask & (1 << j)) && tl[j] < ray.t) ray.t = tl[j], best = i + j;
+	}
+	if (best == -1) return;
+	ray.objIdx = objIdx[best], ray.matId = matId[best];
+	ray.SetNormal(float3(nx[best], ny[best], nz[best]));
+}
+
+bool PlaneList::IsOccluding(const Ray& ray, float t_min) const {
+	for (uint i = 0; i < count; i += 4) {
+		__m128 t;
+		Distances(i, ray, t);
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(t_min)), _mm_cmplt_ps(t, _mm_set1_ps(ray.t)));
+		if (_mm_movemask_ps(hit)) return true;
+	}
+	return false;
 }
 
 void bvh::Subdivide(uint nodeIdx) {
@@ -228,7 +551,11 @@ void bvh::Subdivide(uint nodeIdx) {
 		case SplitMethod::BINNEDSAH: {
 			float splitCost = FindBestSplitPlane(node, axis, splitPos);
 			float nosplitCost = CalculateNodeCost(node);
-			if (splitCost >= nosplitCost) return;
+			if (splitCost >= nosplitCost) {
+				// leaves hold a single primitive type: a mixed node is split by type
+				if (!IsMixed(node)) return;
+				axis = -1;
+			}
 			break;
 		}
 		case SplitMethod::LONGESTAXIS: {
@@ -250,15 +577,7 @@ void bvh::Subdivide(uint nodeIdx) {
 			for (uint i = 0; i < node.primCount; i++)
 			{
 				uint primIdx = primitiveIdx[node.leftFirst + i];
-				if (primIdx < NTri) {
-					Triangle& triangle = getTriangle(primIdx);
-					sorted.push_back(make_tuple(triangle.centroid[axis],primIdx));
-				}
-				else if (primIdx >= NTri && primIdx < NTri + NSph) {
-					primIdx -= NTri;
-					Sphere& sphere = scene->spheres[primIdx];
-					sorted.push_back(make_tuple(sphere.pos[axis], primIdx));
-				}
+				sorted.push_back(make_tuple(centroid[primIdx][axis], primIdx));
 			}
 			sort(sorted.begin(), sorted.end());
 			float mid = get<0>(sorted[m]);
@@ -272,15 +591,7 @@ void bvh::Subdivide(uint nodeIdx) {
 			float candidatePos = 0;
 			for(int a = 0; a < 3; a++) for(uint i = 0; i < node.primCount; i++){
 				uint primIdx = primitiveIdx[node.leftFirst + i];
-				if (primIdx < NTri) {
-					Triangle& triangle = getTriangle(primIdx);
-					candidatePos = triangle.centroid[a];
-				}
-				else if (primIdx >= NTri && primIdx < NTri + NSph) {
-					primIdx -= NTri;
-					Sphere& sphere = scene->spheres[primIdx];
-					candidatePos = sphere.pos[a];
-				}
+				candidatePos = centroid[primIdx][a];
 				float splitCost = EvaluateSAH(node, a, candidatePos);
 				if (splitCost < bestCost)
 					bestPos = candidatePos, bestAxis = a, bestCost = splitCost;
@@ -295,25 +606,20 @@ void bvh::Subdivide(uint nodeIdx) {
 	// in-place partition
 	int i = node.leftFirst;
 	int j = i + node.primCount - 1;
-	while (i <= j)
+	while (axis != -1 && i <= j)
 	{
-		uint primIdx = primitiveIdx[i];
-		if (primIdx < NTri) {
-			if (getTriangle(primIdx).centroid[axis] < splitPos)
-				i++;
-			else
-				swap(primitiveIdx[i], primitiveIdx[j--]);
-		} else if (primIdx >= NTri && primIdx < N) {
-			primIdx -= NTri;
-			if (scene->spheres[primIdx].pos[axis] < splitPos)
-				i++;
-			else
-				swap(primitiveIdx[i], primitiveIdx[j--]);
-		}
+		if (centroid[primitiveIdx[i]][axis] < splitPos)
+			i++;
+		else
+			swap(primitiveIdx[i], primitiveIdx[j--]);
 	}
-	// abort split if one of the sides is empty
+	// abort split if one of the sides is empty, unless types must be separated
 	int leftCount = i - node.leftFirst;
-	if (leftCount == 0 || leftCount == node.primCount) return;
+	if (axis == -1 || leftCount == 0 || leftCount == node.primCount) {
+		if (!IsMixed(node)) return;
+		i = PartitionByType(node);
+		leftCount = i - node.leftFirst;
+	}
 	// create child nodes
 	int leftChildIdx = nodesUsed++;
 	int rightChildIdx = nodesUsed++;
@@ -322,7 +628,8 @@ void bvh::Subdivide(uint nodeIdx) {
 	bvhNode[rightChildIdx].leftFirst = i;
 	bvhNode[rightChildIdx].primCount = node.primCount - leftCount;
 	node.leftFirst = leftChildIdx;
-	node.primCount = 0;
+	// interior: the split axis picks the near child during traversal
+	node.primCount = (uint)max(axis, 0) << BVH_ORDER_SHIFT;
 	dataCollector->UpdateTreeDepth(false);
 	UpdateNodeBounds(leftChildIdx);
 	UpdateNodeBounds(rightChildIdx);
@@ -338,7 +645,7 @@ void bvh::Cut(uint nodeIdx, int& axis, float& splitPos) {
 		case SplitMethod::BINNEDSAH: {
 			float splitCost = FindBestSplitPlane(node, axis, splitPos);
 			float nosplitCost = CalculateNodeCost(node);
-			if (splitCost >= nosplitCost) return;
+			if (splitCost >= nosplitCost) axis = -1; // declined: keep the leaf
 			break;
 		}
 		case SplitMethod::LONGESTAXIS: {
@@ -364,16 +671,8 @@ void bvh::Cut(uint nodeIdx, int& axis, float& splitPos) {
 			float candidatePos = 0;
 			for (int a = 0; a < 3; a++) for (uint i = 0; i < node.primCount; i++) {
 				uint primIdx = primitiveIdx[node.leftFirst + i];
-				if (primIdx < NTri) {
-					Triangle& triangle = getTriangle(primIdx);
-					candidatePos = triangle.centroid[a];
-				}
-				else if (primIdx >= NTri && primIdx < NTri + NSph) {
-					primIdx -= NTri;
-					Sphere& sphere = scene->spheres[primIdx];
-					candidatePos = sphere.pos[a];
-				}
-				float splitCost = EvaluateSAH(node, axis, candidatePos);
+				candidatePos = centroid[primIdx][a];
+				float splitCost = EvaluateSAH(node, a, candidatePos);
 				if (splitCost < bestCost)
 					bestPos = candidatePos, bestAxis = a, bestCost = splitCost;
 			}
@@ -386,25 +685,16 @@ void bvh::Cut(uint nodeIdx, int& axis, float& splitPos) {
 
 int bvh::Partition(uint nodeIdx, int axis, float splitPos) {
 	BVHNode& node = bvhNode[nodeIdx];
+	if (axis == -1) return -1; // Cut declined
 	// in-place partition
 	int i = node.leftFirst;
 	int j = i + node.primCount - 1;
 	while (i <= j)
 	{
-		uint primIdx = primitiveIdx[i];
-		if (primIdx < NTri) {
-			if (getTriangle(primIdx).centroid[axis] < splitPos)
-				i++;
-			else
-				swap(primitiveIdx[i], primitiveIdx[j--]);
-		}
-		else if (primIdx >= NTri && primIdx < N) {
-			primIdx -= NTri;
-			if (scene->spheres[primIdx].pos[axis] < splitPos)
-				i++;
-			else
-				swap(primitiveIdx[i], primitiveIdx[j--]);
-		}
+		if (centroid[primitiveIdx[i]][axis] < splitPos)
+			i++;
+		else
+			swap(primitiveIdx[i], primitiveIdx[j--]);
 	}
 	// abort split if one of the sides is empty
 	int leftCount = i - node.leftFirst;
@@ -413,14 +703,27 @@ int bvh::Partition(uint nodeIdx, int axis, float splitPos) {
 	return leftCount;
 }
 
+int bvh::QPartition(uint nodeIdx, int& axis) {
+	// Cut and Partition; leaves hold a single primitive type, so a mixed
+	// node that would stay a leaf is split by type instead (axis -1)
+	BVHNode& node = bvhNode[nodeIdx];
+	float splitPos = 0;
+	axis = -1;
+	Cut(nodeIdx, axis, splitPos);
+	int leftCount = Partition(nodeIdx, axis, splitPos);
+	if (leftCount != -1 || !IsMixed(node)) return leftCount;
+	axis = -1;
+	return PartitionByType(node) - node.leftFirst;
+}
+
 void bvh::QSubdivide(uint nodeIdx) {
 	BVHNode& node = bvhNode[nodeIdx];
-	int axis = -1; float splitPos = 0;
+	int axis = -1;
 
 	//cout << "First Cut : IDX :" << nodeIdx << endl;
-	Cut(nodeIdx, axis, splitPos);
-	int leftCount = Partition(nodeIdx, axis, splitPos);
+	int leftCount = QPartition(nodeIdx, axis);
 	if(leftCount == -1) return;
+	uint axis0 = max(axis, 0);
 
 	// create child nodes
 	int leftLeftChildIdx = nodesUsed++;
@@ -435,12 +738,16 @@ void bvh::QSubdivide(uint nodeIdx) {
 	node.primCount = 0;
 
 	//cout << "Second cut" << endl;
-	axis = -1; splitPos = 0;
-	Cut(leftLeftChildIdx, axis, splitPos);
-	int leftLeftCount = Partition(leftLeftChildIdx, axis, splitPos);
-	axis = -1; splitPos = 0;
-	Cut(rightChildIdx, axis, splitPos);
-	int rightCount = Partition(rightChildIdx, axis, splitPos);
+	UpdateNodeBounds(leftLeftChildIdx);
+	UpdateNodeBounds(rightChildIdx);
+	int leftLeftCount = QPartition(leftLeftChildIdx, axis);
+	uint axis1 = max(axis, 0);
+	int rightCount = QPartition(rightChildIdx, axis);
+	uint axis2 = max(axis, 0);
+	// the three split axes and which halves were split select the child
+	// order per ray octant, see QBVHOrder
+	uint layout = leftLeftCount != -1 ? (rightCount != -1 ? QBVH_FOUR : QBVH_LEFT3) : (rightCount != -1 ? QBVH_RIGHT3 : QBVH_TWO);
+	node.primCount = (axis0 | axis1 << 2 | axis2 << 4 | layout << 6) << BVH_ORDER_SHIFT;
 	
 	if (leftLeftCount != -1) {
 		bvhNode[leftChildIdx].leftFirst = leftLeftCount + bvhNode[leftLeftChildIdx].leftFirst;
@@ -452,7 +759,6 @@ void bvh::QSubdivide(uint nodeIdx) {
 			//set end
 			bvhNode[rightRightChildIdx].leftFirst = 1;
 			bvhNode[rightRightChildIdx].primCount = 0;
-			return;
 		}
 		else {
 			//four nodes : OK
@@ -471,7 +777,6 @@ void bvh::QSubdivide(uint nodeIdx) {
 			bvhNode[rightChildIdx].primCount = 0;
 			bvhNode[rightRightChildIdx].leftFirst = 1;
 			bvhNode[rightRightChildIdx].primCount = 0;
-			return;
 		}
 		else {
 			//three nodes : OK
@@ -486,7 +791,6 @@ void bvh::QSubdivide(uint nodeIdx) {
 			//set end
 			bvhNode[rightRightChildIdx].leftFirst = 1;
 			bvhNode[rightRightChildIdx].primCount = 0;
-			return;
 		}
 	}
 
@@ -511,122 +815,415 @@ void bvh::QSubdivide(uint nodeIdx) {
 	dataCollector->UpdateTreeDepth(true);
 }
 
+static uchar qbvhOrder[256][8];
+
+static bool InitQBVHOrder()
+{
+	// for every order code and ray octant: the child slots, near to far,
+	// packed as four 2-bit slot indices (empty slots last)
+	for (uint code = 0; code < 256; code++) for (uint octant = 0; octant < 8; octant++)
+	{
+		uint a0 = code & 3, a1 = (code >> 2) & 3, a2 = (code >> 4) & 3, layout = code >> 6;
+		auto neg = [&](uint a) { return a < 3 && ((octant >> a) & 1); };
+		vector<uint> left, right, order;
+		switch (layout) {
+			case QBVH_FOUR: left = { 0, 1 }, right = { 2, 3 }; break;
+			case QBVH_LEFT3: left = { 0, 1 }, right = { 2 }; break;
+			case QBVH_RIGHT3: left = { 0 }, right = { 1, 2 }; break;
+			case QBVH_TWO: left = { 0 }, right = { 1 }; break;
+		}
+		if (left.size() == 2 && neg(a1)) swap(left[0], left[1]);
+		if (right.size() == 2 && neg(a2)) swap(right[0], right[1]);
+		if (neg(a0)) swap(left, right);
+		order = left;
+		order.insert(order.end(), right.begin(), right.end());
+		for (uint slot = 0; slot < 4; slot++)
+			if (find(order.begin(), order.end(), slot) == order.end()) order.push_back(slot);
+		qbvhOrder[code][octant] = (uchar)(order[0] | order[1] << 2 | order[2] << 4 | order[3] << 6);
+	}
+	return true;
+}
+static bool qbvhOrderReady = InitQBVHOrder();
+
 float bvh::EvaluateSAH(BVHNode& node, int axis, float pos)
 {
-	// determine triangle counts and bounds for this split candidate
+	// determine primitive counts and bounds for this split candidate
 	aabb leftBox, rightBox;
 	int leftCount = 0, rightCount = 0;
 	for (uint i = 0; i < node.primCount; i++)
 	{
 		uint primIdx = primitiveIdx[node.leftFirst + i];
-		if (primIdx < NTri) {
-			Triangle& triangle = getTriangle(primIdx);
-			if (triangle.centroid[axis] < pos) {
-				leftCount++;
-				leftBox.grow(triangle.v0);
-				leftBox.grow(triangle.v1);
-				leftBox.grow(triangle.v2);
-			}
-			else {
-				rightCount++;
-				rightBox.grow(triangle.v0);
-				rightBox.grow(triangle.v1);
-				rightBox.grow(triangle.v2);
-			}
-		} else if (primIdx >= NTri && primIdx < N) {
-			primIdx -= NTri;
-			Sphere& sphere = scene->spheres[primIdx];
-			if (sphere.pos[axis] < pos) {
-				leftCount++;
-				leftBox.grow(sphere.pos[axis] - float3(sphere.r));
-				leftBox.grow(sphere.pos[axis] + float3(sphere.r));
-			}
-			else {
-				rightCount++;
-				rightBox.grow(sphere.pos[axis] - float3(sphere.r));
-				rightBox.grow(sphere.pos[axis] + float3(sphere.r));
-			}
+		if (centroid[primIdx][axis] < pos) {
+			leftCount++;
+			leftBox.grow(primBounds[primIdx]);
+		}
+		else {
+			rightCount++;
+			rightBox.grow(primBounds[primIdx]);
 		}
-			
 	}
 	float cost = leftCount * leftBox.area() + rightCount * rightBox.area();
 	return cost > 0 ? cost : 1e30f;
 }
 
-void bvh::Refit()
+void bvh::LinkParents()
 {
-	for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+	delete[] parentIdx;
+	delete[] pendingChildren;
+	delete[] dirtyNode;
+	parentIdx = new uint[nodesUsed];
+	pendingChildren = new atomic<int>[nodesUsed];
+	dirtyNode = new atomic<char>[nodesUsed];
+	leafNodes.clear();
+	if (N == 0) return;
+	vector<uint> stack = { rootNodeIdx };
+	parentIdx[rootNodeIdx] = rootNodeIdx;
+	while (!stack.empty())
 	{
-		BVHNode& node = bvhNode[i];
-		if (isQBVH && node.isEmpty()) continue;
-		if (node.isLeaf())
+		uint nodeIdx = stack.back();
+		stack.pop_back();
+		BVHNode& node = bvhNode[nodeIdx];
+		pendingChildren[nodeIdx] = 0;
+		dirtyNode[nodeIdx] = 0;
+		if (node.isLeaf()) { leafNodes.push_back(nodeIdx); continue; }
+		for (uint c = 0; c < (isQBVH ? 4u : 2u); c++)
 		{
-			// leaf node: adjust bounds to contained triangles
-			UpdateNodeBounds(i);
-			continue;
+			uint childIdx = node.leftFirst + c;
+			if (isQBVH && bvhNode[childIdx].isEmpty()) continue;
+			parentIdx[childIdx] = nodeIdx;
+			stack.push_back(childIdx);
 		}
-		// interior node: adjust bounds to child node bounds
-		BVHNode& leftChild = bvhNode[node.leftFirst];
-		BVHNode& rightChild = bvhNode[node.leftFirst + 1];
-		node.aabbMin = fminf(leftChild.aabbMin, rightChild.aabbMin);
-		node.aabbMax = fmaxf(leftChild.aabbMax, rightChild.aabbMax);
-		if (isQBVH) {
-			BVHNode& child3 = bvhNode[node.leftFirst + 2];
-			BVHNode& child4 = bvhNode[node.leftFirst + 3];
-			if (!child3.isEmpty() && !child4.isEmpty()) {
-				float3 min34 = fminf(child3.aabbMin, child4.aabbMin);
-				node.aabbMin = fminf(node.aabbMin, min34);
-				float3 max34 = fmaxf(child3.aabbMax, child4.aabbMax);
-				node.aabbMax = fmaxf(node.aabbMax, max34);
-			}
-			else {
-				if (child3.isEmpty() && !child4.isEmpty()) {
-					node.aabbMin = fminf(node.aabbMin, child4.aabbMin);
-					node.aabbMax = fmaxf(node.aabbMax, child4.aabbMax);
-				}
-				if (child4.isEmpty() && !child3.isEmpty()) {
-					node.aabbMin = fminf(node.aabbMin, child3.aabbMin);
-					node.aabbMax = fmaxf(node.aabbMax, child3.aabbMax);
-				}
+	}
+}
+
+void bvh::MarkDirty(uint nodeIdx)
+{
+	// the first thread to flag a node reports it to its parent, so that
+	// pendingChildren ends up holding the number of dirty children
+	while (!dirtyNode[nodeIdx].exchange(1))
+	{
+		if (nodeIdx == rootNodeIdx) return;
+		nodeIdx = parentIdx[nodeIdx];
+		pendingChildren[nodeIdx]++;
+	}
+}
+
+void bvh::RefitInterior(uint nodeIdx)
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	// interior node: adjust bounds to child node bounds
+	BVHNode& leftChild = bvhNode[node.leftFirst];
+	BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+	node.aabbMin = fminf(leftChild.aabbMin, rightChild.aabbMin);
+	node.aabbMax = fmaxf(leftChild.aabbMax, rightChild.aabbMax);
+	if (isQBVH) {
+		BVHNode& child3 = bvhNode[node.leftFirst + 2];
+		BVHNode& child4 = bvhNode[node.leftFirst + 3];
+		if (!child3.isEmpty()) {
+			node.aabbMin = fminf(node.aabbMin, child3.aabbMin);
+			node.aabbMax = fmaxf(node.aabbMax, child3.aabbMax);
+		}
+		if (!child4.isEmpty()) {
+			node.aabbMin = fminf(node.aabbMin, child4.aabbMin);
+			node.aabbMax = fmaxf(node.aabbMax, child4.aabbMax);
+		}
+	}
+}
+
+void bvh::Refit(const uchar* dirtyPrims)
+{
+	const int leafCount = (int)leafNodes.size();
+	// flag the leaves that contain a moved primitive, and their ancestors
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < leafCount; i++)
+	{
+		BVHNode& leaf = bvhNode[leafNodes[i]];
+		bool dirty = dirtyPrims == nullptr;
+		for (uint j = 0; !dirty && j < leaf.primCount; j++)
+			dirty = dirtyPrims[GlobalIndex(primitiveIdx[leaf.leftFirst + j])] != 0;
+		if (dirty) MarkDirty(leafNodes[i]);
+	}
+	// bottom-up: the last dirty child to finish refits its parent
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < leafCount; i++)
+	{
+		uint nodeIdx = leafNodes[i];
+		if (!dirtyNode[nodeIdx]) continue;
+		RefitLeaf(nodeIdx);
+		dirtyNode[nodeIdx] = 0;
+		while (nodeIdx != rootNodeIdx)
+		{
+			nodeIdx = parentIdx[nodeIdx];
+			if (--pendingChildren[nodeIdx] > 0) break;
+			RefitInterior(nodeIdx);
+			dirtyNode[nodeIdx] = 0;
+		}
+	}
+	BVHNode& root = bvhNode[rootNodeIdx];
+	bounds = aabb();
+	bounds.grow(root.aabbMin);
+	bounds.grow(root.aabbMax);
+}
+
+float bvh::SAHCost()
+{
+	// expected traversal cost relative to the root: sum of node areas,
+	// interior nodes weighted by a traversal step, leaves by their prims
+	BVHNode& root = bvhNode[rootNodeIdx];
+	float3 e = root.aabbMax - root.aabbMin;
+	float rootArea = e.x * e.y + e.y * e.z + e.z * e.x;
+	if (N == 0) return 0;
+	if (!(rootArea > 0)) rootArea = 1;
+	float cost = 0;
+#pragma omp parallel for reduction(+:cost) schedule(static)
+	for (int i = 0; i < (int)nodesUsed; i++)
+	{
+		if (i == 1) continue; // unused, keeps sibling pairs aligned
+		BVHNode& node = bvhNode[i];
+		if (node.isEmpty()) continue;
+		float3 n = node.aabbMax - node.aabbMin;
+		float area = n.x * n.y + n.y * n.z + n.z * n.x;
+		cost += area * (node.isLeaf() ? node.primCount : 1.0f);
+	}
+	return cost / rootArea;
+}
+
+void bvh::Update(const uchar* dirtyPrims)
+{
+	if (builder != nullptr && builder->rebuildDone) AdoptRebuild();
+	else Refit(dirtyPrims);
+	float cost = SAHCost();
+	if (builder == nullptr && cost > rebuildThreshold * buildCost) StartRebuild();
+}
+
+void bvh::StartRebuild()
+{
+	// the builder gets its own stats collector; only the snapshot is taken
+	// on this thread, the tree is constructed while rendering continues
+	builder = scene != nullptr ? new bvh(scene) : new bvh(mesh);
+	builder->splitMethod = splitMethod;
+	builder->isQBVH = isQBVH;
+	builder->topLevel = topLevel;
+	builder->CountPrimitives();
+	builder->GatherBuildInput();
+	bvh* b = builder;
+	buildThread = thread([b]() {
+		b->Construct();
+		b->rebuildDone = true;
+	});
+}
+
+void bvh::AdoptRebuild()
+{
+	// called between frames, so nothing is traversing the old tree
+	buildThread.join();
+	// the cloud copies live spheres, so it is filled here rather than on the
+	// worker, which only sees the snapshot
+	builder->BuildSphereCloud();
+	swap(bvhNode, builder->bvhNode);
+	swap(primitiveIdx, builder->primitiveIdx);
+	swap(sphereCloud, builder->sphereCloud);
+	swap(nodesUsed, builder->nodesUsed);
+	delete[] builder->bvhNode;
+	delete[] builder->primitiveIdx;
+	delete builder->dataCollector;
+	delete builder;
+	builder = nullptr;
+	// the snapshot is a few frames old: bring every node up to date
+	LinkParents();
+	Refit();
+	buildCost = SAHCost();
+	dataCollector->UpdateNodeCount(nodesUsed);
+}
+
+void bvh::Intersect(Ray& ray, TraversalMode mode) {
+	// planes first: a near plane hit shortens the ray for the traversal
+	planes.Intersect(ray, 0.0001f);
+	if (N > 0) {
+		if (mode == TRAVERSE_STACKLESS) StacklessIntersect(ray);
+		else if (isQBVH) QIntersect(ray);
+		else BIntersect(ray);
+	}
+	// triangles only record mesh and face; resolve normal and material once
+	if (ray.hitMesh) ray.hitMesh->FetchHitAttributes(ray);
+}
+
+// closest hit as BIntersect, appending the index of every node it visits
+// to visited: for studies of the traversal's memory access pattern
+void bvh::IntersectRecord(Ray& ray, vector<uint>& visited) {
+	// the walk of StacklessIntersect, which IntersectBatch also follows,
+	// recording each node whose box is read; FirstChild and NextNode cover
+	// binary and QBVH layouts alike
+	planes.Intersect(ray, 0.0001f);
+	if (N > 0) {
+		const float t_min = 0.0001f;
+		const uint dirNeg[3] = { ray.D.x < 0, ray.D.y < 0, ray.D.z < 0 };
+		const uint octant = dirNeg[0] | dirNeg[1] << 1 | dirNeg[2] << 2;
+		visited.push_back(rootNodeIdx);
+		if (bvhNode[rootNodeIdx].isLeaf()) IntersectLeaf(bvhNode[rootNodeIdx], ray, t_min);
+		else for (uint nodeIdx = FirstChild(rootNodeIdx, dirNeg, octant); nodeIdx != rootNodeIdx;) {
+			visited.push_back(nodeIdx);
+			BVHNode& node = bvhNode[nodeIdx];
+			if (IntersectAABB(ray, node.aabbMin, node.aabbMax) != 1e30f) {
+				if (!node.isLeaf()) { nodeIdx = FirstChild(nodeIdx, dirNeg, octant); continue; }
+				IntersectLeaf(node, ray, t_min);
 			}
+			nodeIdx = NextNode(nodeIdx, dirNeg, octant);
 		}
 	}
+	if (ray.hitMesh) ray.hitMesh->FetchHitAttributes(ray);
 }
 
-void bvh::Intersect(Ray& ray) {
-	if(isQBVH) QIntersect(ray);
-	else BIntersect(ray);
+bool bvh::IsOccludedCached(Ray& ray, uint& leafIdx, TraversalMode mode) {
+	// shadow rays from neighbouring pixels to the same light tend to be
+	// blocked by the same geometry: retest the leaf that blocked the last
+	// one before traversing. leafIdx is 0 when nothing is cached; a stale
+	// index after a rebuild only costs a wasted test.
+	if (leafIdx != 0 && leafIdx < nodesUsed && bvhNode[leafIdx].isLeaf() &&
+		OccludeLeaf(bvhNode[leafIdx], ray, 0.0001f)) return true;
+	ray.occluder = 0;
+	if (!IsOccluded(ray, mode)) return false;
+	leafIdx = ray.occluder;
+	return true;
+}
+
+// slab test of one box against four rays; returns the mask of lanes that
+// hit it
+static inline int IntersectAABBPacket(const BVHNode& node, const __m128 O[3], const __m128 rD[3], const __m128 t4)
+{
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMin.x), O[0]), rD[0]);
+	__m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMax.x), O[0]), rD[0]);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMin.y), O[1]), rD[1]);
+	__m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMax.y), O[1]), rD[1]);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMin.z), O[2]), rD[2]);
+	__m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.aabbMax.z), O[2]), rD[2]);
+	__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+	__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+	__m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, t4)), _mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+	return _mm_movemask_ps(hit);
+}
+
+int bvh::IsOccludedPacket(Ray* rays, int count) {
+	// up to four shadow rays, e.g. samples on an area light seen from one
+	// shading point. Each node costs one SSE slab test for all lanes; a lane
+	// leaves the packet once occluded, the packet ends when all have.
+	// Returns the mask of occluded lanes.
+	float t_min = 0.0001f;
+	const int live = (1 << count) - 1;
+	int done = 0;
+	for (int k = 0; k < count; k++) if (planes.IsOccluding(rays[k], t_min)) done |= 1 << k;
+	if (N == 0 || done == live) return done;
+	// lanes in SoA form; unused lanes get t = 0 and never hit
+	float o[3][4] = {}, rD[3][4] = {}, t[4] = {};
+	for (int k = 0; k < count; k++) {
+		o[0][k] = rays[k].O.x, o[1][k] = rays[k].O.y, o[2][k] = rays[k].O.z;
+		rD[0][k] = rays[k].rD.x, rD[1][k] = rays[k].rD.y, rD[2][k] = rays[k].rD.z, t[k] = rays[k].t;
+	}
+	const __m128 O[3] = { _mm_loadu_ps(o[0]), _mm_loadu_ps(o[1]), _mm_loadu_ps(o[2]) };
+	const __m128 rD4[3] = { _mm_loadu_ps(rD[0]), _mm_loadu_ps(rD[1]), _mm_loadu_ps(rD[2]) };
+	const __m128 t4 = _mm_loadu_ps(t);
+	const uint childCount = isQBVH ? 4 : 2;
+	// each entry keeps the lanes that hit its box
+	uint stack[BVH_STACK_SIZE];
+	int laneStack[BVH_STACK_SIZE];
+	uint stackPtr = 0, nodeIdx = rootNodeIdx;
+	int lanes = live & ~done;
+	while (1) {
+		BVHNode& node = bvhNode[nodeIdx];
+		lanes &= ~done;
+		if (lanes && node.isLeaf()) {
+			for (int k = 0; k < count; k++)
+				if ((lanes >> k) & 1 && OccludeLeaf(node, rays[k], t_min)) done |= 1 << k;
+			if (done == live) return done;
+		}
+		else if (lanes) for (uint c = 0; c < childCount; c++) {
+			BVHNode& child = bvhNode[node.leftFirst + c];
+			if (child.isEmpty()) continue;
+			int mask = IntersectAABBPacket(child, O, rD4, t4) & lanes;
+			if (!mask) continue;
+			if (stackPtr == BVH_STACK_SIZE) {
+				// out of stack: finish the remaining lanes one by one
+				for (int k = 0; k < count; k++)
+					if (!((done >> k) & 1) && IsOccluded(rays[k], TRAVERSE_STACKLESS)) done |= 1 << k;
+				return done;
+			}
+			stack[stackPtr] = node.leftFirst + c, laneStack[stackPtr++] = mask;
+		}
+		if (stackPtr == 0) return done;
+		nodeIdx = stack[--stackPtr], lanes = laneStack[stackPtr];
+	}
 }
 
-bool bvh::IsOccluded(Ray& ray) {
+bool bvh::IsOccluded(Ray& ray, TraversalMode mode) {
+	if (planes.IsOccluding(ray, 0.0001f)) return true;
+	if (N == 0) return false;
+	if (mode == TRAVERSE_STACKLESS) return StacklessIsOccluded(ray);
 	if (isQBVH) return QIsOccluded(ray);
 	else return BIsOccluded(ray);
 }
 
+void bvh::IntersectLeaf(const BVHNode& leaf, Ray& ray, float t_min) {
+	// leaves are type-homogeneous: dispatch once, then run the batch
+	const uint* ref = primitiveIdx + leaf.leftFirst;
+	switch (PrimType(ref[0])) {
+		case PRIM_TRIANGLE:
+			for (uint i = 0; i < leaf.primCount; i++) {
+				uint triIdx = PrimIndex(ref[i]);
+				TriMesh(triIdx).IntersectFace(triIdx, ray, t_min);
+			}
+			break;
+		case PRIM_SPHERE:
+			sphereCloud.Intersect(PrimIndex(ref[0]), leaf.primCount, ray, t_min);
+			break;
+		case PRIM_CUBE:
+			for (uint i = 0; i < leaf.primCount; i++)
+				scene->cubes[PrimIndex(ref[i])].Intersect(ray, t_min);
+			break;
+		case PRIM_DISC:
+			for (uint i = 0; i < leaf.primCount; i++)
+				discs[PrimIndex(ref[i])]->Intersect(ray, t_min);
+			break;
+	}
+	for (uint i = 0; i < leaf.primCount; i++) dataCollector->UpdateIntersectedPrimitives();
+}
+
+bool bvh::OccludeLeaf(const BVHNode& leaf, Ray& ray, float t_min) {
+	const uint* ref = primitiveIdx + leaf.leftFirst;
+	bool occluded = false;
+	switch (PrimType(ref[0])) {
+		case PRIM_TRIANGLE:
+			for (uint i = 0; i < leaf.primCount && !occluded; i++) {
+				uint triIdx = PrimIndex(ref[i]);
+				occluded = TriMesh(triIdx).IsOccludingFace(triIdx, ray, t_min);
+			}
+			break;
+		case PRIM_SPHERE:
+			occluded = sphereCloud.IsOccluding(PrimIndex(ref[0]), leaf.primCount, ray, t_min);
+			break;
+		case PRIM_CUBE:
+			for (uint i = 0; i < leaf.primCount && !occluded; i++)
+				occluded = scene->cubes[PrimIndex(ref[i])].IsOccluding(ray, t_min);
+			break;
+		case PRIM_DISC:
+			break; // lights do not cast shadows
+	}
+	// remembered for the occluder cache, see IsOccludedCached
+	if (occluded) ray.occluder = (uint)(&leaf - bvhNode);
+	return occluded;
+}
+
 void bvh::BIntersect(Ray& ray) {
 	float t_min = 0.0001f;
-	BVHNode* node = &bvhNode[rootNodeIdx], *stack[64];
+	const uint dirNeg[3] = { ray.D.x < 0, ray.D.y < 0, ray.D.z < 0 };
+	BVHNode* node = &bvhNode[rootNodeIdx], *stack[BVH_STACK_SIZE];
 	uint stackPtr = 0;
 	int traversalSteps = 0;
 
 	// trace transformed ray
 	while(1){
 		traversalSteps++;
-		if (node->primCount > 0) {
-			for (uint i = 0; i < node->primCount; i++) {
-				uint primIdx = primitiveIdx[node->leftFirst + i];
-				if (primIdx < NTri) {
-					getTriangle(primIdx).Intersect(ray, t_min);
-				} else if(primIdx >=NTri && primIdx < NTri + NSph){
-					primIdx -= NTri;
-					scene->spheres[primIdx].Intersect(ray, t_min);
-				}
-				else {
-					primIdx -= NTri + NSph;
-					scene->planes[primIdx].Intersect(ray, t_min);
-				}
-				dataCollector->UpdateIntersectedPrimitives();
-			}
+		if (node->isLeaf()) {
+			IntersectLeaf(*node, ray, t_min);
 			if (stackPtr == 0) { 
 				dataCollector->UpdateAverageTraversalSteps(traversalSteps);
 				break; 
@@ -635,8 +1232,11 @@ void bvh::BIntersect(Ray& ray) {
 			continue;
 		}
 
-		BVHNode* c1 = &bvhNode[node->leftFirst];
-		BVHNode* c2 = &bvhNode[node->leftFirst + 1];
+		// near child from the split axis and the ray direction sign;
+		// siblings are pairs (2k, 2k+1)
+		uint nearIdx = node->leftFirst + dirNeg[node->primCount >> BVH_ORDER_SHIFT];
+		BVHNode* c1 = &bvhNode[nearIdx];
+		BVHNode* c2 = &bvhNode[nearIdx ^ 1];
 #ifdef USE_SSE
 		float dist1 = IntersectAABB_SSE(ray, c1->aabbMin4, c1->aabbMax4);
 		float dist2 = IntersectAABB_SSE(ray, c2->aabbMin4, c2->aabbMax4);
@@ -644,20 +1244,25 @@ void bvh::BIntersect(Ray& ray) {
 		float dist1 = IntersectAABB(ray, c1->aabbMin, c1->aabbMax);
 		float dist2 = IntersectAABB(ray, c2->aabbMin, c2->aabbMax);
 #endif
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
+		if (dist1 == 1e30f) swap(dist1, dist2), swap(c1, c2);
 		if (dist1 == 1e30f) {
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 		}
 		else {
 			node = c1;
-			if (dist2 != 1e30f) stack[stackPtr++] = c2;
+			if (dist2 != 1e30f) {
+				// deeper than the stack: finish this ray without one
+				if (stackPtr == BVH_STACK_SIZE) { StacklessIntersect(ray); return; }
+				stack[stackPtr++] = c2;
+			}
 		}
 	}
 }
 
 void bvh::QIntersect(Ray& ray) {
 	float t_min = 0.0001f;
-	BVHNode* node = &bvhNode[rootNodeIdx], * stack[64];
+	const uint octant = (ray.D.x < 0) | (ray.D.y < 0) << 1 | (ray.D.z < 0) << 2;
+	BVHNode* node = &bvhNode[rootNodeIdx], * stack[BVH_STACK_SIZE];
 	uint stackPtr = 0;
 	int traversalSteps = 0;
 
@@ -665,10 +1270,7 @@ void bvh::QIntersect(Ray& ray) {
 	while (1) {
 		traversalSteps++;
 		if (node->isLeaf()) {
-			for (uint i = 0; i < node->primCount; i++) {
-				uint primIdx = primitiveIdx[node->leftFirst + i];
-				getTriangle(primIdx).Intersect(ray, t_min);
-			}
+			IntersectLeaf(*node, ray, t_min);
 			if (stackPtr == 0) {
 				break;
 			}
@@ -676,39 +1278,34 @@ void bvh::QIntersect(Ray& ray) {
 			continue;
 		}
 
-		BVHNode* c1 = &bvhNode[node->leftFirst];
-		BVHNode* c2 = &bvhNode[node->leftFirst + 1];
-		BVHNode* c3 = &bvhNode[node->leftFirst + 2];
-		BVHNode* c4 = &bvhNode[node->leftFirst + 3];
+		// children in near-to-far order for this ray's octant; push the
+		// far ones first so the nearest is popped next
+		uint order = qbvhOrder[node->primCount >> BVH_ORDER_SHIFT][octant];
+		if (stackPtr > BVH_STACK_SIZE - 4) { StacklessIntersect(ray); return; }
+		for (int k = 3; k >= 0; k--) {
+			BVHNode* c = &bvhNode[node->leftFirst + ((order >> (2 * k)) & 3)];
+			if (c->isEmpty()) continue;
 #ifdef USE_SSE
-		float dist1 = IntersectAABB_SSE(ray, c1->aabbMin4, c1->aabbMax4);
-		float dist2 = IntersectAABB_SSE(ray, c2->aabbMin4, c2->aabbMax4);
+			if (IntersectAABB_SSE(ray, c->aabbMin4, c->aabbMax4) != 1e30f) stack[stackPtr++] = c;
 #else
-
-		float dist1 = IntersectAABB(ray, c1->aabbMin, c1->aabbMax);
-		float dist2 = IntersectAABB(ray, c2->aabbMin, c2->aabbMax);
-		float dist3 = IntersectAABB(ray, c3->aabbMin, c3->aabbMax);
-		float dist4 = IntersectAABB(ray, c4->aabbMin, c4->aabbMax);
-
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
-		if (dist2 > dist3) { swap(dist2, dist3); swap(c2, c3); }
-		if (dist3 > dist4) { swap(dist3, dist4); swap(c3, c4); }
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
-		if (dist2 > dist3) { swap(dist2, dist3); swap(c2, c3); }
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
+			if (IntersectAABB(ray, c->aabbMin, c->aabbMax) != 1e30f) stack[stackPtr++] = c;
 #endif
-
-		if (dist4 != 1e30f && !c4->isEmpty()) stack[stackPtr++] = c4;
-		if (dist3 != 1e30f && !c3->isEmpty()) stack[stackPtr++] = c3;
-		if (dist2 != 1e30f && !c2->isEmpty()) stack[stackPtr++] = c2;
-		if(dist1 != 1e30f && !c1->isEmpty()) stack[stackPtr++] = c1;
+		}
 		if (stackPtr == 0) break; else node = stack[--stackPtr];
 	}
 }
 
+static inline float HalfArea(const BVHNode& node)
+{
+	float3 e = node.aabbMax - node.aabbMin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
 bool bvh::QIsOccluded(Ray& ray) {
+	// any hit ends the query, so distance order buys nothing: visit the
+	// largest children first, they are the most likely to hold an occluder
 	float t_min = 0.0001f;
-	BVHNode* node = &bvhNode[rootNodeIdx], * stack[64];
+	BVHNode* node = &bvhNode[rootNodeIdx], * stack[BVH_STACK_SIZE];
 	uint stackPtr = 0;
 	int traversalSteps = 0;
 
@@ -716,11 +1313,7 @@ bool bvh::QIsOccluded(Ray& ray) {
 	while (1) {
 		traversalSteps++;
 		if (node->isLeaf()) {
-			for (uint i = 0; i < node->primCount; i++) {
-				uint primIdx = primitiveIdx[node->leftFirst + i];
-				if (getTriangle(primIdx).IsOccluding(ray, t_min))
-					return true;
-			}
+			if (OccludeLeaf(*node, ray, t_min)) return true;
 			if (stackPtr == 0) {
 				break;
 			}
@@ -728,32 +1321,25 @@ bool bvh::QIsOccluded(Ray& ray) {
 			continue;
 		}
 
-		BVHNode* c1 = &bvhNode[node->leftFirst];
-		BVHNode* c2 = &bvhNode[node->leftFirst + 1];
-		BVHNode* c3 = &bvhNode[node->leftFirst + 2];
-		BVHNode* c4 = &bvhNode[node->leftFirst + 3];
+		// push hit children smallest first, so the largest is popped next
+		if (stackPtr > BVH_STACK_SIZE - 4) return StacklessIsOccluded(ray);
+		BVHNode* hit[4];
+		float area[4];
+		uint hits = 0;
+		for (uint k = 0; k < 4; k++) {
+			BVHNode* c = &bvhNode[node->leftFirst + k];
+			if (c->isEmpty()) continue;
 #ifdef USE_SSE
-		float dist1 = IntersectAABB_SSE(ray, c1->aabbMin4, c1->aabbMax4);
-		float dist2 = IntersectAABB_SSE(ray, c2->aabbMin4, c2->aabbMax4);
+			if (IntersectAABB_SSE(ray, c->aabbMin4, c->aabbMax4) == 1e30f) continue;
 #else
-
-		float dist1 = IntersectAABB(ray, c1->aabbMin, c1->aabbMax);
-		float dist2 = IntersectAABB(ray, c2->aabbMin, c2->aabbMax);
-		float dist3 = IntersectAABB(ray, c3->aabbMin, c3->aabbMax);
-		float dist4 = IntersectAABB(ray, c4->aabbMin, c4->aabbMax);
-
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
-		if (dist2 > dist3) { swap(dist2, dist3); swap(c2, c3); }
-		if (dist3 > dist4) { swap(dist3, dist4); swap(c3, c4); }
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
-		if (dist2 > dist3) { swap(dist2, dist3); swap(c2, c3); }
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
+			if (IntersectAABB(ray, c->aabbMin, c->aabbMax) == 1e30f) continue;
 #endif
-
-		if (dist4 != 1e30f && !c4->isEmpty()) stack[stackPtr++] = c4;
-		if (dist3 != 1e30f && !c3->isEmpty()) stack[stackPtr++] = c3;
-		if (dist2 != 1e30f && !c2->isEmpty()) stack[stackPtr++] = c2;
-		if (dist1 != 1e30f && !c1->isEmpty()) stack[stackPtr++] = c1;
+			float a = HalfArea(*c);
+			uint j = hits++;
+			while (j > 0 && area[j - 1] > a) hit[j] = hit[j - 1], area[j] = area[j - 1], j--;
+			hit[j] = c, area[j] = a;
+		}
+		for (uint k = 0; k < hits; k++) stack[stackPtr++] = hit[k];
 		if (stackPtr == 0) break; else node = stack[--stackPtr];
 	}
 
@@ -761,26 +1347,14 @@ bool bvh::QIsOccluded(Ray& ray) {
 }
 
 bool bvh::BIsOccluded(Ray& ray) {
+	// any hit will do: larger child first, see QIsOccluded
 	float t_min = 0.0001f;
-	BVHNode* node = &bvhNode[rootNodeIdx], * stack[64];
+	BVHNode* node = &bvhNode[rootNodeIdx], * stack[BVH_STACK_SIZE];
 	uint stackPtr = 0;
 	while (1) {
 		//if (!IntersectAABB(ray, node->aabbMin, node->aabbMax)) return;
-		if (node->primCount > 0) {
-			for (uint i = 0; i < node->primCount; i++) {
-				uint primIdx = primitiveIdx[node->leftFirst + i];
-				if (primIdx < NTri) {
-					if (getTriangle(primIdx).IsOccluding(ray, t_min)) return true;
-				}
-				else if (primIdx >= NTri && primIdx < NTri + NSph) {
-					primIdx -= NTri;
-					if (scene->spheres[primIdx].IsOccluding(ray, t_min)) return true;
-				}
-				else {
-					primIdx -= NTri + NSph;
-					if (scene->planes[primIdx].IsOccluding(ray, t_min)) return true;
-				}
-			}
+		if (node->isLeaf()) {
+			if (OccludeLeaf(*node, ray, t_min)) return true;
 			if (stackPtr == 0) return false; else node = stack[--stackPtr];
 			continue;
 		}
@@ -794,13 +1368,151 @@ bool bvh::BIsOccluded(Ray& ray) {
 		float dist1 = IntersectAABB(ray, c1->aabbMin, c1->aabbMax);
 		float dist2 = IntersectAABB(ray, c2->aabbMin, c2->aabbMax);
 #endif
-		if (dist1 > dist2) { swap(dist1, dist2); swap(c1, c2); }
+		if (dist1 == 1e30f) swap(dist1, dist2), swap(c1, c2);
 		if (dist1 == 1e30f) {
 			if (stackPtr == 0) return false; else node = stack[--stackPtr];
 		}
 		else {
+			if (dist2 != 1e30f && HalfArea(*c2) > HalfArea(*c1)) swap(c1, c2);
 			node = c1;
-			if (dist2 != 1e30f) stack[stackPtr++] = c2;
+			if (dist2 != 1e30f) {
+				if (stackPtr == BVH_STACK_SIZE) return StacklessIsOccluded(ray);
+				stack[stackPtr++] = c2;
+			}
+		}
+	}
+}
+
+uint bvh::FirstChild(uint nodeIdx, const uint* dirNeg, uint octant)
+{
+	// nearest child, using the same order codes as the stack traversal
+	BVHNode& node = bvhNode[nodeIdx];
+	uint code = node.primCount >> BVH_ORDER_SHIFT;
+	if (!isQBVH) return node.leftFirst + dirNeg[code];
+	uint order = qbvhOrder[code][octant];
+	for (int k = 0; k < 4; k++) {
+		uint childIdx = node.leftFirst + ((order >> (2 * k)) & 3);
+		if (!bvhNode[childIdx].isEmpty()) return childIdx;
+	}
+	return rootNodeIdx;
+}
+
+uint bvh::NextSibling(uint nodeIdx, const uint* dirNeg, uint octant)
+{
+	// the sibling visited after nodeIdx, or the root (never a child) if none
+	BVHNode& parent = bvhNode[parentIdx[nodeIdx]];
+	uint code = parent.primCount >> BVH_ORDER_SHIFT;
+	if (!isQBVH) return nodeIdx == parent.leftFirst + dirNeg[code] ? nodeIdx ^ 1 : rootNodeIdx;
+	uint order = qbvhOrder[code][octant];
+	bool after = false;
+	for (int k = 0; k < 4; k++) {
+		uint childIdx = parent.leftFirst + ((order >> (2 * k)) & 3);
+		if (after && !bvhNode[childIdx].isEmpty()) return childIdx;
+		if (childIdx == nodeIdx) after = true;
+	}
+	return rootNodeIdx;
+}
+
+uint bvh::NextNode(uint nodeIdx, const uint* dirNeg, uint octant)
+{
+	// done with nodeIdx: next sibling, climbing up until there is one;
+	// the root when the traversal is complete
+	while (nodeIdx != rootNodeIdx) {
+		uint sibling = NextSibling(nodeIdx, dirNeg, octant);
+		if (sibling != rootNodeIdx) return sibling;
+		nodeIdx = parentIdx[nodeIdx];
+	}
+	return rootNodeIdx;
+}
+
+void bvh::StacklessIntersect(Ray& ray) {
+	// parent-link traversal: the whole per-ray state is the current node,
+	// siblings and parents are found from the tree itself
+	float t_min = 0.0001f;
+	const uint dirNeg[3] = { ray.D.x < 0, ray.D.y < 0, ray.D.z < 0 };
+	const uint octant = dirNeg[0] | dirNeg[1] << 1 | dirNeg[2] << 2;
+	if (bvhNode[rootNodeIdx].isLeaf()) { IntersectLeaf(bvhNode[rootNodeIdx], ray, t_min); return; }
+	uint nodeIdx = FirstChild(rootNodeIdx, dirNeg, octant);
+	while (nodeIdx != rootNodeIdx) {
+		BVHNode& node = bvhNode[nodeIdx];
+		if (IntersectAABB(ray, node.aabbMin, node.aabbMax) != 1e30f) {
+			if (!node.isLeaf()) { nodeIdx = FirstChild(nodeIdx, dirNeg, octant); continue; }
+			IntersectLeaf(node, ray, t_min);
+		}
+		nodeIdx = NextNode(nodeIdx, dirNeg, octant);
+	}
+}
+
+bool bvh::StacklessIsOccluded(Ray& ray) {
+	float t_min = 0.0001f;
+	const uint dirNeg[3] = { ray.D.x < 0, ray.D.y < 0, ray.D.z < 0 };
+	const uint octant = dirNeg[0] | dirNeg[1] << 1 | dirNeg[2] << 2;
+	if (bvhNode[rootNodeIdx].isLeaf()) return OccludeLeaf(bvhNode[rootNodeIdx], ray, t_min);
+	uint nodeIdx = FirstChild(rootNodeIdx, dirNeg, octant);
+	while (nodeIdx != rootNodeIdx) {
+		BVHNode& node = bvhNode[nodeIdx];
+		if (IntersectAABB(ray, node.aabbMin, node.aabbMax) != 1e30f) {
+			if (!node.isLeaf()) { nodeIdx = FirstChild(nodeIdx, dirNeg, octant); continue; }
+			if (OccludeLeaf(node, ray, t_min)) return true;
+		}
+		nodeIdx = NextNode(nodeIdx, dirNeg, octant);
+	}
+	return false;
+}
+
+// per-ray state of the interleaved traversal; as in StacklessIntersect,
+// the current node is all that needs keeping between steps
+struct BatchLane { Ray* ray; uint nodeIdx, octant, dirNeg[3]; };
+
+void bvh::IntersectBatch(Ray* rays, uint count) {
+	// BVH_BATCH_LANES rays advance one node at a time in round-robin; each
+	// step prefetches the lane's next node, which then has the other lanes'
+	// steps to arrive before it is used
+	float t_min = 0.0001f;
+	BatchLane lane[BVH_BATCH_LANES];
+	uint nextRay = 0, active = 0;
+	// put the next ray that needs traversal in a lane; others finish here
+	auto Start = [&](BatchLane& l) -> bool {
+		while (nextRay < count) {
+			Ray& ray = rays[nextRay++];
+			planes.Intersect(ray, t_min);
+			if (N > 0) {
+				if (!bvhNode[rootNodeIdx].isLeaf()) {
+					l.ray = &ray;
+					l.dirNeg[0] = ray.D.x < 0, l.dirNeg[1] = ray.D.y < 0, l.dirNeg[2] = ray.D.z < 0;
+					l.octant = l.dirNeg[0] | l.dirNeg[1] << 1 | l.dirNeg[2] << 2;
+					l.nodeIdx = FirstChild(rootNodeIdx, l.dirNeg, l.octant);
+					_mm_prefetch((const char*)&bvhNode[l.nodeIdx], _MM_HINT_T0);
+					return true;
+				}
+				IntersectLeaf(bvhNode[rootNodeIdx], ray, t_min);
+			}
+			if (ray.hitMesh) ray.hitMesh->FetchHitAttributes(ray);
+		}
+		return false;
+	};
+	while (active < BVH_BATCH_LANES && Start(lane[active])) active++;
+	while (active > 0) {
+		for (uint i = 0; i < active;) {
+			BatchLane& l = lane[i];
+			Ray& ray = *l.ray;
+			BVHNode& node = bvhNode[l.nodeIdx];
+			uint nodeIdx = rootNodeIdx;
+			if (IntersectAABB(ray, node.aabbMin, node.aabbMax) != 1e30f) {
+				if (!node.isLeaf()) nodeIdx = FirstChild(l.nodeIdx, l.dirNeg, l.octant);
+				else IntersectLeaf(node, ray, t_min);
+			}
+			if (nodeIdx == rootNodeIdx) nodeIdx = NextNode(l.nodeIdx, l.dirNeg, l.octant);
+			if (nodeIdx != rootNodeIdx) {
+				l.nodeIdx = nodeIdx;
+				_mm_prefetch((const char*)&bvhNode[nodeIdx], _MM_HINT_T0);
+				i++;
+				continue;
+			}
+			// ray done: refill the lane, or retire it
+			if (ray.hitMesh) ray.hitMesh->FetchHitAttributes(ray);
+			if (!Start(l)) l = lane[--active];
+			else i++;
 		}
 	}
 }
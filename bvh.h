@@ -1,12 +1,29 @@
 #pragma once
-#define TRIANGLES 0
-#define SPHERES 1
+// primitive references: type in the top bits, index within that type below
+#define PRIM_TYPE_SHIFT 29
+#define PRIM_INDEX_MASK ((1u << PRIM_TYPE_SHIFT) - 1)
+// interior nodes keep a child order code in the top byte of primCount:
+// the split axis (binary), or three axes and a layout (QBVH)
+#define BVH_ORDER_SHIFT 24
+#define BVH_STACK_SIZE 64 // deeper paths finish in stackless mode
+#define BVH_BATCH_LANES 8 // rays in flight per thread in IntersectBatch
+#ifdef __AVX__
+#define SPHERE_LANES 8 // spheres per SIMD test in SphereCloud
+#else
+#define SPHERE_LANES 4
+#endif
+enum TraversalMode { TRAVERSE_STACK = 0, TRAVERSE_STACKLESS = 1 };
+enum QBVHLayout { QBVH_FOUR = 0, QBVH_LEFT3 = 1, QBVH_RIGHT3 = 2, QBVH_TWO = 3 };
+enum PrimitiveType { PRIM_TRIANGLE = 0, PRIM_SPHERE = 1, PRIM_CUBE = 2, PRIM_DISC = 3, PRIM_TYPES };
 namespace Tmpl8{
 	class Scene;
 	class Ray;
 	class DataCollector;
 	class Mesh;
-	class Triangle;
+	class Plane;
+	class Sphere;
+	class material;
+	class AreaLight;
 struct BVHNode
 {
 	union
@@ -19,7 +36,7 @@ struct BVHNode
 		struct { float3 aabbMax; uint primCount; };
 		__m128 aabbMax4;
 	};
-	bool isLeaf() { return primCount > 0; }
+	bool isLeaf() { return (primCount & ((1u << BVH_ORDER_SHIFT) - 1)) != 0; }
 	bool isEmpty() { return primCount == 0 && leftFirst == 1; }
 };
 
@@ -35,6 +52,34 @@ struct aabb
 	}
 };
 
+// spheres in leaf order, stored SoA so that a leaf is tested SPHERE_LANES at a time;
+// rebuilt on the main thread after every construction, see bvh::BuildSphereCloud
+struct SphereCloud
+{
+	vector<float> cx, cy, cz, r2, invr;
+	vector<int> objIdx;
+	vector<ushort> matId; // into material::Table()
+	vector<uint> source; // index into scene->spheres
+	void Clear();
+	void Set(uint slot, const Sphere& sphere);
+	void Intersect(uint first, uint count, Ray& ray, float t_min) const;
+	bool IsOccluding(uint first, uint count, const Ray& ray, float t_min) const;
+};
+
+// unbounded primitives (infinite planes) live outside the tree: they are
+// tested four at a time before traversal starts, clipping the ray's t
+struct PlaneList
+{
+	vector<float> nx, ny, nz, d;
+	vector<int> objIdx;
+	vector<ushort> matId;
+	uint count = 0;
+	void Set(const vector<Plane>& planes);
+	void Distances(uint i, const Ray& ray, __m128& t) const;
+	void Intersect(Ray& ray, float t_min) const;
+	bool IsOccluding(const Ray& ray, float t_min) const;
+};
+
 enum SplitMethod {
 	BINNEDSAH = 0,
 	SAMESIZE = 1,
@@ -47,14 +92,21 @@ class bvh
 	public:
 		bvh(Scene* s);
 		bvh(Mesh* m);
+		~bvh();
 
 		void Build(bool isQ = false);
+		void CountPrimitives();
+		void GatherBuildInput();
+		void Construct();
 		void UpdateNodeBounds(uint nodeIdx);
 		void Subdivide(uint rootNodeIdx);
 		void Cut(uint nodeIdx, int& axis, float& splitPos);
 		int Partition(uint nodeIdx, int axis, float splitPos);
+		int QPartition(uint nodeIdx, int& axis);
 		void QSubdivide(uint nodeIdx);
-		void Intersect(Ray& ray);
+		void Intersect(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
+		void IntersectBatch(Ray* rays, uint count);
+		void IntersectRecord(Ray& ray, vector<uint>& visited);
 
 		static float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax);
 		float IntersectAABB_SSE(const Ray& ray, const __m128 bmin4, const __m128 bmax4);
@@ -62,18 +114,52 @@ class bvh
 		float CalculateNodeCost(BVHNode& node);
 		float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos);
 		
-		bool IsOccluded(Ray& ray);
-		void separatePlanes(uint nodeIdx);
-		void Refit();
-		Triangle getTriangle(uint idx);
+		bool IsOccluded(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
+		bool IsOccludedCached(Ray& ray, uint& leafIdx, TraversalMode mode = TRAVERSE_STACK);
+		int IsOccludedPacket(Ray* rays, int count);
+		void LinkParents();
+		void Refit(const uchar* dirtyPrims = nullptr);
+		void Update(const uchar* dirtyPrims = nullptr);
+		float SAHCost();
+		const Mesh& TriMesh(uint& idx) const;
+		const Mesh& LocateTriangle(uint& idx) const;
+		static uint MakePrimRef(uint type, uint idx) { return (type << PRIM_TYPE_SHIFT) | idx; }
+		static uint PrimType(uint ref) { return ref >> PRIM_TYPE_SHIFT; }
+		static uint PrimIndex(uint ref) { return ref & PRIM_INDEX_MASK; }
+		uint GlobalIndex(uint ref) const;
 	private:
 		bool BIsOccluded(Ray& ray);
 		void BIntersect(Ray& ray);
 		bool QIsOccluded(Ray& ray);
 		void QIntersect(Ray& ray);
+		void StacklessIntersect(Ray& ray);
+		bool StacklessIsOccluded(Ray& ray);
+		uint FirstChild(uint nodeIdx, const uint* dirNeg, uint octant);
+		uint NextSibling(uint nodeIdx, const uint* dirNeg, uint octant);
+		uint NextNode(uint nodeIdx, const uint* dirNeg, uint octant);
+		void MarkDirty(uint nodeIdx);
+		void RefitInterior(uint nodeIdx);
+		void RefitLeaf(uint nodeIdx);
+		uint TypeOf(uint primIdx) const;
+		bool IsMixed(BVHNode& node) const;
+		int PartitionByType(BVHNode& node);
+		void PackPrimRefs();
+		void BuildSphereCloud();
+		void IntersectLeaf(const BVHNode& leaf, Ray& ray, float t_min);
+		bool OccludeLeaf(const BVHNode& leaf, Ray& ray, float t_min);
+		void StartRebuild();
+		void AdoptRebuild();
 	public:
-		uint rootNodeIdx = 0, nodesUsed = 2, NTri = 0, NSph = 0, NPla = 0, N = 0;
-		uint* primitiveIdx;
+		uint rootNodeIdx = 0, nodesUsed = 2, NTri = 0, NSph = 0, NCub = 0, NDisc = 0, N = 0;
+		uint* primitiveIdx; // global indices while building, packed references after
+		uint typeBase[PRIM_TYPES] = {}; // global index of each type's first primitive
+		SphereCloud sphereCloud; // sphere references index this, not scene->spheres
+		vector<AreaLight*> discs; // the scene's area lights, indexed by disc references
+		vector<uint> meshFirst; // scene-wide index of each mesh's first triangle
+		uint faceBits = PRIM_TYPE_SHIFT; // face bits of a packed triangle reference
+		PlaneList planes;
+		float3* centroid = nullptr; // primitive centroids, build time only
+		aabb* primBounds = nullptr; // primitive bounds, build time only
 		class Scene* scene;
 		BVHNode* bvhNode; //- 1];
 		Mesh* mesh;
@@ -82,7 +168,21 @@ class bvh
 		class DataCollector* dataCollector;
 		int splitMethod;
 		bool isQBVH = false;
-		
+		// bvh(Scene*) under a TLAS: the meshes are instanced and the TLAS tests
+		// the planes, so only spheres, cubes and discs go in
+		bool topLevel = false;
+		// refit bookkeeping, see LinkParents
+		uint* parentIdx = nullptr;
+		atomic<int>* pendingChildren = nullptr;
+		atomic<char>* dirtyNode = nullptr;
+		vector<uint> leafNodes;
+		// background rebuild, see Update
+		float buildCost = 0;
+		float rebuildThreshold = 1.3f; // rebuild once refits degrade SAH cost by 30%
+		bvh* builder = nullptr;
+		thread buildThread;
+		atomic<bool> rebuildDone = false;
+
 };
 
 struct Bin { aabb bounds; int primCount = 0; };
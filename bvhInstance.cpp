@@ -1,44 +1,72 @@
 #include "precomp.h"
 
-void bvhInstance::BIntersect(Ray& ray)
+bvhInstance::bvhInstance(tlas* sub) : tl(sub)
 {
-    // backup ray and transform original
-    Ray backupRay = ray;
-    ray.O = TransformPosition(ray.O, invTransform);
-    ray.D = TransformVector(ray.D, invTransform);
-    ray.rD = float3(1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z);
-    // trace ray through BVH
-    bvh->Intersect(ray);
-    if (backupRay.t > ray.t) {
-        backupRay.m = ray.m;
-        backupRay.t = ray.t;
-        backupRay.objIdx = ray.objIdx;
-        backupRay.hitNormal = normalize(TransformVector(ray.hitNormal, matTransform));
-    }
-    
-    //restore ray origin and direction
-    ray = backupRay;
+    // nesting is resolved by recursion; keep it shallow
+    if (sub->level >= MAX_INSTANCE_LEVELS)
+        FATALERROR("TLAS nesting deeper than %d levels", MAX_INSTANCE_LEVELS);
+    SetTransform(mat4());
 }
 
-bool bvhInstance::IsOccluded(Ray& ray)
+void bvhInstance::ToObjectSpace(Ray& ray) const
 {
-    // backup ray and transform original
-    Ray backupRay = ray;
-    ray.O = TransformPosition(ray.O, invTransform);
-    ray.D = TransformVector(ray.D, invTransform);
-    ray.rD = float3(1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z);
-    // trace ray through BVH
-    bool res = bvh->IsOccluded(ray);
-    //restore ray origin and direction
-    ray = backupRay;
+    // affine 3x4 transform of origin and direction; w lanes stay 0
+    const __m128 O4 = ray.O4, D4 = ray.D4;
+    const __m128 Ox = _mm_shuffle_ps(O4, O4, _MM_SHUFFLE(0, 0, 0, 0));
+    const __m128 Oy = _mm_shuffle_ps(O4, O4, _MM_SHUFFLE(1, 1, 1, 1));
+    const __m128 Oz = _mm_shuffle_ps(O4, O4, _MM_SHUFFLE(2, 2, 2, 2));
+    const __m128 Dx = _mm_shuffle_ps(D4, D4, _MM_SHUFFLE(0, 0, 0, 0));
+    const __m128 Dy = _mm_shuffle_ps(D4, D4, _MM_SHUFFLE(1, 1, 1, 1));
+    const __m128 Dz = _mm_shuffle_ps(D4, D4, _MM_SHUFFLE(2, 2, 2, 2));
+    ray.O4 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(invCol[0], Ox), _mm_mul_ps(invCol[1], Oy)),
+        _mm_add_ps(_mm_mul_ps(invCol[2], Oz), invCol[3]));
+    ray.D4 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(invCol[0], Dx), _mm_mul_ps(invCol[1], Dy)), _mm_mul_ps(invCol[2], Dz));
+    // one division for all three reciprocals; lane 3 must stay 0 for the slab test
+    const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    ray.rD4 = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1), ray.D4), xyzMask);
+}
+
+float3 bvhInstance::NormalToWorld(const float3& n) const
+{
+    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(invRow[0], _mm_set1_ps(n.x)), _mm_mul_ps(invRow[1], _mm_set1_ps(n.y))),
+        _mm_mul_ps(invRow[2], _mm_set1_ps(n.z)));
+    return normalize(float3(r.m128_f32[0], r.m128_f32[1], r.m128_f32[2]));
+}
+
+void bvhInstance::BIntersect(Ray& ray, TraversalMode mode)
+{
+    // only origin and direction change in object space (t is preserved by
+    // an affine map), so those are all that needs restoring afterwards
+    const __m128 O4 = ray.O4, D4 = ray.D4, rD4 = ray.rD4;
+    const float tPrev = ray.t;
+    ToObjectSpace(ray);
+    // trace ray through BVH, or through the nested TLAS
+    if (bvh) bvh->Intersect(ray, mode);
+    else tl->Intersect(ray, mode);
+    // hit attributes are only written by a closer hit
+    if (ray.t < tPrev) ray.hitNormal = NormalToWorld(ray.hitNormal);
+    ray.O4 = O4, ray.D4 = D4, ray.rD4 = rD4;
+}
+
+bool bvhInstance::IsOccluded(Ray& ray, TraversalMode mode)
+{
+    const __m128 O4 = ray.O4, D4 = ray.D4, rD4 = ray.rD4;
+    ToObjectSpace(ray);
+    // trace ray through BVH, or through the nested TLAS
+    bool res = bvh ? bvh->IsOccluded(ray, mode) : tl->IsOccluded(ray, mode);
+    ray.O4 = O4, ray.D4 = D4, ray.rD4 = rD4;
     return res;
 }
 
-void bvhInstance::SetTransform(mat4& transform) {
+void bvhInstance::SetTransform(const mat4& transform) {
     invTransform = transform.Inverted();
-    matTransform = transform;
+    const float* c = invTransform.cell;
+    for (int i = 0; i < 4; i++) invCol[i] = _mm_setr_ps(c[i], c[4 + i], c[8 + i], 0);
+    for (int i = 0; i < 3; i++) invRow[i] = _mm_setr_ps(c[4 * i], c[4 * i + 1], c[4 * i + 2], 0);
     // calculate world-space bounds using the new matrix
-    float3 bmin = bvh->bounds.bmin, bmax = bvh->bounds.bmax;
+    bounds = Tmpl8::aabb();
+    float3 bmin = bvh ? bvh->bounds.bmin : tl->tlasNode[0].aabbMin;
+    float3 bmax = bvh ? bvh->bounds.bmax : tl->tlasNode[0].aabbMax;
     for (int i = 0; i < 8; i++)
         bounds.grow(TransformPosition(float3(i & 1 ? bmax.x : bmin.x, i & 2 ? bmax.y : bmin.y, i & 4 ? bmax.z : bmin.z), transform));
 }
\ No newline at end of file
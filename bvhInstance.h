@@ -1,20 +1,30 @@
 
 #pragma once
 
-// instance of a BVH, with transform and world bounds
+class tlas;
+
+// instance of a BVH or of a whole TLAS, with transform and world bounds.
+// Instancing a TLAS nests a sub-assembly: transforms compose level by level
+// as the ray is brought into each space in turn.
 class bvhInstance
 {
 public:
     bvhInstance() = default;
-    bvhInstance(bvh* blas) : bvh(blas) { SetTransform(mat4()); bounds = bvh->bounds; }
-    void SetTransform(mat4& transform);
-    void BIntersect(Ray& ray);
-    bool IsOccluded(Ray& ray);
+    bvhInstance(bvh* blas) : bvh(blas) { SetTransform(mat4()); }
+    bvhInstance(tlas* sub);
+    void SetTransform(const mat4& transform);
+    void BIntersect(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
+    bool IsOccluded(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
 private:
+    void ToObjectSpace(Ray& ray) const;
+    float3 NormalToWorld(const float3& n) const;
     mat4 invTransform; // inverse transform
-    mat4 matTransform;
+    // inverse transform as 3x4 columns, for rays, and 3x3 rows, for normals
+    // (the inverse transpose); recomputed by SetTransform
+    __m128 invCol[4];
+    __m128 invRow[3];
 public:
     bvh* bvh = 0;
+    tlas* tl = 0; // set instead of bvh for a nested TLAS
     Tmpl8::aabb bounds; // in world space
 };
-
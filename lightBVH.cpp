@@ -0,0 +1,141 @@
+#include "precomp.h"
+
+// smallest cone holding cones (a, thetaA) and (b, thetaB)
+static void MergeCones(float3& a, float& thetaA, float3 b, float thetaB)
+{
+	if (thetaB > thetaA) swap(a, b), swap(thetaA, thetaB);
+	float thetaD = acosf(clamp(dot(a, b), -1.0f, 1.0f));
+	if (min(thetaD + thetaB, PI) <= thetaA) return;
+	float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+	float3 ortho = b - a * dot(a, b);
+	if (thetaO >= PI || dot(ortho, ortho) < 1e-12f) { thetaA = PI; return; }
+	// rotate a towards b until the new cone touches both
+	float thetaR = thetaO - thetaA;
+	a = normalize(cosf(thetaR) * a + sinf(thetaR) * normalize(ortho));
+	thetaA = thetaO;
+}
+
+void lightBVH::Build(const vector<Light*>& lights)
+{
+	const uint L = (uint)lights.size();
+	lightNode.clear(), lightIdx.resize(L), leafOf.resize(L);
+	lightMin.resize(L), lightMax.resize(L), lightAxis.resize(L);
+	lightThetaO.resize(L), lightPower.resize(L);
+	if (L == 0) return;
+	for (uint i = 0; i < L; i++)
+	{
+		// discs emit from their front side; other lights are points that
+		// shine in all directions
+		Light* light = lights[i];
+		lightIdx[i] = i;
+		float3 col = light->GetLightColor();
+		lightPower[i] = light->strength * (0.2126f * col.x + 0.7152f * col.y + 0.0722f * col.z);
+		if (AreaLight* disc = dynamic_cast<AreaLight*>(light))
+		{
+			disc->Bounds(lightMin[i], lightMax[i]);
+			lightAxis[i] = normalize(disc->normal), lightThetaO[i] = 0;
+		}
+		else lightMin[i] = lightMax[i] = light->pos, lightAxis[i] = float3(0, 1, 0), lightThetaO[i] = PI;
+	}
+	lightNode.resize(2 * L);
+	parentIdx.assign(2 * L, 0);
+	nodesUsed = 2;
+	Subdivide(0, 0, L);
+}
+
+void lightBVH::UpdateNode(uint nodeIdx, uint first, uint count)
+{
+	LightNode& node = lightNode[nodeIdx];
+	node.aabbMin = float3(1e30f), node.aabbMax = float3(-1e30f);
+	node.axis = lightAxis[lightIdx[first]], node.thetaO = lightThetaO[lightIdx[first]];
+	node.thetaE = PI * 0.5f, node.power = 0;
+	for (uint i = first; i < first + count; i++)
+	{
+		uint l = lightIdx[i];
+		node.aabbMin = fminf(node.aabbMin, lightMin[l]);
+		node.aabbMax = fmaxf(node.aabbMax, lightMax[l]);
+		if (i != first) MergeCones(node.axis, node.thetaO, lightAxis[l], lightThetaO[l]);
+		node.power += lightPower[l];
+	}
+}
+
+void lightBVH::Subdivide(uint nodeIdx, uint first, uint count)
+{
+	UpdateNode(nodeIdx, first, count);
+	LightNode& node = lightNode[nodeIdx];
+	if (count == 1)
+	{
+		node.leftFirst = lightIdx[first], node.count = 1;
+		leafOf[lightIdx[first]] = nodeIdx;
+		return;
+	}
+	// median split over the longest axis of the light centroids
+	float3 cmin(1e30f), cmax(-1e30f);
+	for (uint i = first; i < first + count; i++)
+	{
+		float3 c = (lightMin[lightIdx[i]] + lightMax[lightIdx[i]]) * 0.5f;
+		cmin = fminf(cmin, c), cmax = fmaxf(cmax, c);
+	}
+	float3 e = cmax - cmin;
+	int axis = e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+	uint half = count / 2;
+	nth_element(lightIdx.begin() + first, lightIdx.begin() + first + half, lightIdx.begin() + first + count,
+		[&](uint a, uint b) { return lightMin[a][axis] + lightMax[a][axis] < lightMin[b][axis] + lightMax[b][axis]; });
+	// children take the next free pair of nodes
+	uint leftIdx = nodesUsed;
+	nodesUsed += 2;
+	node.leftFirst = leftIdx, node.count = 0;
+	parentIdx[leftIdx] = parentIdx[leftIdx + 1] = nodeIdx;
+	Subdivide(leftIdx, first, half);
+	Subdivide(leftIdx + 1, first + half, count - half);
+}
+
+float lightBVH::Importance(const LightNode& node, const float3& P, const float3& N) const
+{
+	// power over squared distance, scaled by the best-case cosines at the
+	// receiver and at the emitters, given the node's bounds and cone
+	float3 c = (node.aabbMin + node.aabbMax) * 0.5f, d = c - P;
+	float r2 = 0.25f * dot(node.aabbMax - node.aabbMin, node.aabbMax - node.aabbMin);
+	float dist2 = max(dot(d, d), r2); // no blow-up inside or near the bounds
+	float dist = sqrtf(dist2);
+	float3 w = d / dist;
+	float thetaU = dot(d, d) > r2 ? asinf(min(1.0f, sqrtf(r2) / dist)) : PI;
+	float thetaI = max(0.0f, acosf(clamp(dot(N, w), -1.0f, 1.0f)) - thetaU);
+	if (thetaI >= PI * 0.5f) return 0;
+	float thetaL = max(0.0f, acosf(clamp(-dot(node.axis, w), -1.0f, 1.0f)) - node.thetaO - thetaU);
+	if (thetaL >= node.thetaE) return 0;
+	return node.power * cosf(thetaI) * cosf(thetaL) / dist2;
+}
+
+int lightBVH::Pick(const float3& P, const float3& N, float& pmf) const
+{
+	// walk down, taking each child with probability proportional to its
+	// importance; -1 when no light can reach P
+	pmf = 1;
+	if (lightNode.empty()) return -1;
+	uint nodeIdx = 0;
+	while (!lightNode[nodeIdx].isLeaf())
+	{
+		uint left = lightNode[nodeIdx].leftFirst;
+		float i0 = Importance(lightNode[left], P, N), i1 = Importance(lightNode[left + 1], P, N);
+		if (i0 + i1 <= 0) return -1;
+		float p0 = i0 / (i0 + i1);
+		if (RandomFloat() < p0) nodeIdx = left, pmf *= p0;
+		else nodeIdx = left + 1, pmf *= 1 - p0;
+	}
+	return lightNode[nodeIdx].leftFirst;
+}
+
+float lightBVH::Pmf(const float3& P, const float3& N, int light) const
+{
+	// probability that Pick returns light: the choices on its root path
+	if (lightNode.empty()) return 0;
+	float pmf = 1;
+	for (uint nodeIdx = leafOf[light]; nodeIdx != 0; nodeIdx = parentIdx[nodeIdx])
+	{
+		float i = Importance(lightNode[nodeIdx], P, N), iSibling = Importance(lightNode[nodeIdx ^ 1], P, N);
+		if (i <= 0) return 0;
+		pmf *= i / (i + iSibling);
+	}
+	return pmf;
+}
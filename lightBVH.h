@@ -0,0 +1,42 @@
+#pragma once
+namespace Tmpl8 {
+	class Light;
+}
+
+// node of the light tree: bounds, orientation cone and total power of the
+// lights below it. Children are pairs (leftFirst, leftFirst + 1) as in the
+// bvh; a leaf holds a single light.
+struct LightNode
+{
+	float3 aabbMin; uint leftFirst; // first child, or the light for a leaf
+	float3 aabbMax; uint count; // 1 for a leaf, 0 for an interior node
+	float3 axis; float thetaO; // emitter normals lie within thetaO of axis
+	float thetaE; // emission spread around each normal
+	float power;
+	bool isLeaf() const { return count != 0; }
+};
+
+// light hierarchy for many-light sampling: a shading point picks one light
+// by walking down the tree, choosing between the two children in proportion
+// to an importance estimate from their power, distance and orientation.
+// Picking costs O(log L), independent of the number of lights.
+class lightBVH
+{
+public:
+	void Build(const vector<Light*>& lights);
+	int Pick(const float3& P, const float3& N, float& pmf) const;
+	float Pmf(const float3& P, const float3& N, int light) const;
+private:
+	void Subdivide(uint nodeIdx, uint first, uint count);
+	void UpdateNode(uint nodeIdx, uint first, uint count);
+	float Importance(const LightNode& node, const float3& P, const float3& N) const;
+public:
+	vector<LightNode> lightNode; // root at 0, node 1 unused
+	vector<uint> lightIdx; // scene light per leaf slot
+	vector<uint> parentIdx;
+	vector<uint> leafOf; // leaf node per scene light
+	uint nodesUsed = 2;
+	// per-light build input
+	vector<float3> lightMin, lightMax, lightAxis;
+	vector<float> lightThetaO, lightPower;
+};
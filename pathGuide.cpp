@@ -0,0 +1,112 @@
+#include "precomp.h"
+
+void pathGuide::Init(const float3& bmin, const float3& bmax)
+{
+	// a little margin, so points on the outer surfaces fall inside
+	float3 margin = (bmax - bmin) * 0.01f + 1e-3f;
+	gridMin = bmin - margin;
+	float3 size = (bmax + margin - gridMin) * (1.0f / GUIDE_GRID);
+	rcpCellSize = float3(1 / size.x, 1 / size.y, 1 / size.z);
+	if (!bins) bins = new GuideBin[GUIDE_GRID * GUIDE_GRID * GUIDE_GRID * GUIDE_NORMALS * GUIDE_BINS];
+	Reset();
+}
+
+void pathGuide::Reset()
+{
+	const uint count = GUIDE_GRID * GUIDE_GRID * GUIDE_GRID * GUIDE_NORMALS * GUIDE_BINS;
+	for (uint i = 0; i < count; i++) bins[i].q.store(0, memory_order_relaxed), bins[i].n.store(0, memory_order_relaxed);
+}
+
+int pathGuide::Cell(const float3& P, const float3& N) const
+{
+	// points beyond the grid (e.g. on infinite planes) use the border cells
+	int3 c = make_int3((P - gridMin) * rcpCellSize);
+	c.x = clamp(c.x, 0, GUIDE_GRID - 1), c.y = clamp(c.y, 0, GUIDE_GRID - 1), c.z = clamp(c.z, 0, GUIDE_GRID - 1);
+	float3 a = fabs(N);
+	int axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+	int side = axis * 2 + (N[axis] < 0);
+	return ((c.x * GUIDE_GRID + c.y) * GUIDE_GRID + c.z) * GUIDE_NORMALS + side;
+}
+
+int pathGuide::Bin(const float3& D)
+{
+	int band = min(GUIDE_BANDS - 1, (int)((D.z + 1) * 0.5f * GUIDE_BANDS));
+	float phi = atan2f(D.y, D.x) + PI;
+	int sector = min(GUIDE_SECTORS - 1, (int)(phi * INV2PI * GUIDE_SECTORS));
+	return max(0, band) * GUIDE_SECTORS + sector;
+}
+
+float3 pathGuide::binCenter[GUIDE_BINS];
+
+static bool InitBinCenters()
+{
+	for (int bin = 0; bin < GUIDE_BINS; bin++)
+	{
+		float z = -1 + 2 * ((bin / GUIDE_SECTORS) + 0.5f) / GUIDE_BANDS;
+		float phi = TWOPI * ((bin % GUIDE_SECTORS) + 0.5f) / GUIDE_SECTORS - PI;
+		float r = sqrtf(max(0.0f, 1 - z * z));
+		pathGuide::binCenter[bin] = float3(r * cosf(phi), r * sinf(phi), z);
+	}
+	return true;
+}
+static bool binCentersReady = InitBinCenters();
+
+void pathGuide::Mixture(int cell, const float3& N, GuideMixture& m) const
+{
+	// Q-values, plus a share of their mean so that unexplored bins keep
+	// being tried; bins wholly below the surface are left out
+	float total = 0;
+	for (int k = 0; k < GUIDE_BINS; k++) total += m.w[k] = max(0.0f, Q(cell, k));
+	float base = 0.1f * total / GUIDE_BINS + 1e-4f;
+	m.total = 0, m.N = N;
+	for (int k = 0; k < GUIDE_BINS; k++)
+	{
+		m.w[k] = dot(binCenter[k], N) > -0.4f ? m.w[k] + base : 0;
+		m.total += m.w[k];
+	}
+}
+
+float3 pathGuide::Sample(const GuideMixture& m, float& pdf) const
+{
+	const float3& N = m.N;
+	float3 D;
+	if (RandomFloat() < guidedFraction)
+	{
+		// a bin by weight, then uniform within it: uniform in z and phi is
+		// uniform in solid angle
+		float r = RandomFloat() * m.total;
+		int k = 0;
+		while (k < GUIDE_BINS - 1 && r >= m.w[k]) r -= m.w[k++];
+		float z = -1 + 2 * ((k / GUIDE_SECTORS) + RandomFloat()) / GUIDE_BANDS;
+		float phi = TWOPI * ((k % GUIDE_SECTORS) + RandomFloat()) / GUIDE_SECTORS - PI;
+		float s = sqrtf(max(0.0f, 1 - z * z));
+		D = float3(s * cosf(phi), s * sinf(phi), z);
+	}
+	else
+	{
+		float r = sqrtf(RandomFloat()), phi = TWOPI * RandomFloat();
+		float3 t = normalize(cross(fabs(N.x) > 0.9f ? float3(0, 1, 0) : float3(1, 0, 0), N));
+		float3 b = cross(N, t);
+		D = normalize(r * cosf(phi) * t + r * sinf(phi) * b + sqrtf(max(0.0f, 1 - r * r)) * N);
+	}
+	pdf = Pdf(m, D);
+	return D;
+}
+
+float pathGuide::Pdf(const GuideMixture& m, const float3& D) const
+{
+	// density of the mixture Sample draws from
+	float guided = m.total > 0 ? m.w[Bin(D)] / m.total * (GUIDE_BINS / (4 * PI)) : 0;
+	return guidedFraction * guided + (1 - guidedFraction) * max(0.0f, dot(D, m.N)) * INVPI;
+}
+
+void pathGuide::Update(int cell, const float3& D, float radiance)
+{
+	// running mean over the first updates, then an exponential average that
+	// keeps following the rest of the table as it converges
+	GuideBin& bin = bins[cell * GUIDE_BINS + Bin(D)];
+	uint n = bin.n.fetch_add(1, memory_order_relaxed);
+	float alpha = max(1.0f / (n + 1), 0.02f);
+	float q = bin.q.load(memory_order_relaxed);
+	bin.q.store(q + alpha * (radiance - q), memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#define GUIDE_GRID 16 // cells per axis over the scene bounds
+#define GUIDE_NORMALS 6 // cells are split by the dominant axis of the normal
+// direction bins: bands of equal height in z times sectors in phi, so all
+// bins cover the same solid angle
+#define GUIDE_BANDS 8
+#define GUIDE_SECTORS 8
+#define GUIDE_BINS (GUIDE_BANDS * GUIDE_SECTORS)
+
+// one direction bin: learned incident radiance (the Q-value) and the number
+// of updates it has seen
+struct GuideBin
+{
+	atomic<float> q;
+	atomic<uint> n;
+};
+
+// the mixture Sample draws from at one diffuse vertex: the bin weights of
+// its cell, computed once and shared by Sample and every Pdf there
+struct GuideMixture
+{
+	float w[GUIDE_BINS];
+	float total;
+	float3 N;
+};
+
+// path guiding after Dahm & Keller (2017): a grid over the scene stores per
+// cell and direction bin a Q-value, an estimate of the radiance arriving
+// from that direction. Diffuse bounces sample directions in proportion to
+// it, mixed with cosine sampling so no direction gets zero density, and
+// finished paths feed their radiance back. All render threads update the
+// table with relaxed atomics: a lost update only slows learning a little.
+class pathGuide
+{
+public:
+	void Init(const float3& bmin, const float3& bmax);
+	void Reset();
+	int Cell(const float3& P, const float3& N) const;
+	void Mixture(int cell, const float3& N, GuideMixture& m) const;
+	float3 Sample(const GuideMixture& m, float& pdf) const;
+	float Pdf(const GuideMixture& m, const float3& D) const;
+	void Update(int cell, const float3& D, float radiance);
+	float Q(int cell, int bin) const { return bins[cell * GUIDE_BINS + bin].q.load(memory_order_relaxed); }
+	static int Bin(const float3& D);
+	static float3 BinCenter(int bin) { return binCenter[bin]; }
+	static float3 binCenter[GUIDE_BINS]; // direction through the middle of each bin
+public:
+	GuideBin* bins = nullptr;
+	float3 gridMin, rcpCellSize;
+	float guidedFraction = 0.5f; // of the bounces; the rest is cosine sampling
+};
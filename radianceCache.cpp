@@ -0,0 +1,85 @@
+#include "precomp.h"
+
+void radianceCache::Init(const float3& bmin, const float3& bmax)
+{
+	// cells of 1/256th of the largest scene extent
+	float3 e = bmax - bmin;
+	rcpCellSize = 256 / max(max(e.x, e.y), max(e.z, 1e-3f));
+	if (!records) records = new CacheRecord[CACHE_SIZE];
+	Clear();
+}
+
+void radianceCache::Clear()
+{
+	for (uint i = 0; i < CACHE_SIZE; i++)
+	{
+		CacheRecord& rec = records[i];
+		rec.key.store(0, memory_order_relaxed), rec.n.store(0, memory_order_relaxed);
+		rec.r.store(0, memory_order_relaxed), rec.g.store(0, memory_order_relaxed), rec.b.store(0, memory_order_relaxed);
+		rec.lastUsed.store(0, memory_order_relaxed);
+	}
+}
+
+uint64_t radianceCache::Key(const float3& P, const float3& N) const
+{
+	// 20 bits per cell coordinate (wrapping far outside the scene), the
+	// normal's dominant axis and sign, and a top bit so no key is 0
+	float3 a = fabs(N);
+	uint64_t axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+	uint64_t side = axis * 2 + (N[(int)axis] < 0);
+	uint64_t x = (uint64_t)(int)floorf(P.x * rcpCellSize) & 0xFFFFF;
+	uint64_t y = (uint64_t)(int)floorf(P.y * rcpCellSize) & 0xFFFFF;
+	uint64_t z = (uint64_t)(int)floorf(P.z * rcpCellSize) & 0xFFFFF;
+	return x | (y << 20) | (z << 40) | (side << 60) | (1ull << 63);
+}
+
+bool radianceCache::Lookup(const float3& P, const float3& N, const float3& reflectance, float3& radiance)
+{
+	const uint64_t key = Key(P, N);
+	for (uint i = 0, slot = Slot(key); i < CACHE_PROBES; i++, slot = (slot + 1) & (CACHE_SIZE - 1))
+	{
+		CacheRecord& rec = records[slot];
+		uint64_t k = rec.key.load(memory_order_relaxed);
+		if (k == 0) return false;
+		if (k != key) continue;
+		// write the frame only when it changes, to keep the line shared
+		if (rec.lastUsed.load(memory_order_relaxed) != frame) rec.lastUsed.store(frame, memory_order_relaxed);
+		if (rec.n.load(memory_order_relaxed) < CACHE_MIN_SAMPLES) return false;
+		radiance = reflectance * float3(rec.r.load(memory_order_relaxed), rec.g.load(memory_order_relaxed), rec.b.load(memory_order_relaxed));
+		return true;
+	}
+	return false;
+}
+
+void radianceCache::Insert(const float3& P, const float3& N, const float3& reflectance, const float3& radiance)
+{
+	float3 v(reflectance.x > 0 ? radiance.x / reflectance.x : 0,
+		reflectance.y > 0 ? radiance.y / reflectance.y : 0,
+		reflectance.z > 0 ? radiance.z / reflectance.z : 0);
+	const uint64_t key = Key(P, N);
+	CacheRecord* rec = nullptr, *oldest = nullptr;
+	for (uint i = 0, slot = Slot(key); i < CACHE_PROBES && !rec; i++, slot = (slot + 1) & (CACHE_SIZE - 1))
+	{
+		CacheRecord& r = records[slot];
+		uint64_t k = r.key.load(memory_order_relaxed);
+		if (k == 0 && r.key.compare_exchange_strong(k, key, memory_order_relaxed)) rec = &r;
+		else if (k == key) rec = &r;
+		else if (!oldest || r.lastUsed.load(memory_order_relaxed) < oldest->lastUsed.load(memory_order_relaxed)) oldest = &r;
+	}
+	if (!rec)
+	{
+		// evict the least recently used record, unless it is still in use
+		if (frame - oldest->lastUsed.load(memory_order_relaxed) < 2) return;
+		uint64_t k = oldest->key.load(memory_order_relaxed);
+		if (!oldest->key.compare_exchange_strong(k, key, memory_order_relaxed)) return;
+		rec = oldest;
+		rec->n.store(0, memory_order_relaxed);
+	}
+	rec->lastUsed.store(frame, memory_order_relaxed);
+	uint n = rec->n.fetch_add(1, memory_order_relaxed);
+	float alpha = max(1.0f / (n + 1), 1.0f / CACHE_MAX_SAMPLES);
+	float r = rec->r.load(memory_order_relaxed), g = rec->g.load(memory_order_relaxed), b = rec->b.load(memory_order_relaxed);
+	rec->r.store(r + alpha * (v.x - r), memory_order_relaxed);
+	rec->g.store(g + alpha * (v.y - g), memory_order_relaxed);
+	rec->b.store(b + alpha * (v.z - b), memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#define CACHE_SIZE (1 << 19) // records, a power of two: 16MB in total
+#define CACHE_PROBES 8 // slots a key may occupy, searched linearly
+#define CACHE_MIN_SAMPLES 16 // before a record answers lookups
+#define CACHE_MAX_SAMPLES 256 // after this the mean slowly forgets old samples
+
+// one cache record: the mean outgoing radiance of the surface in a grid
+// cell, divided by its diffuse reflectance so that neighbouring materials
+// can share it
+struct CacheRecord
+{
+	atomic<uint64_t> key; // 0 for an empty slot
+	atomic<float> r, g, b;
+	atomic<uint> n; // samples so far
+	atomic<uint> lastUsed; // frame of the last lookup or update
+};
+
+// world-space radiance cache for diffuse interreflection: a hashed grid,
+// keyed by cell and dominant normal direction, of radiance records filled
+// by the path tracers. Hits from the second bounce on take their outgoing
+// radiance from a record with enough samples instead of continuing the
+// path. The table has a fixed size; when all probe slots of a key are
+// taken, the least recently used record is evicted. Render threads insert
+// concurrently: slots are claimed by compare-exchange and records are
+// updated with relaxed atomics, so a lost update only costs a sample.
+class radianceCache
+{
+public:
+	void Init(const float3& bmin, const float3& bmax);
+	void Clear();
+	void NextFrame() { frame++; }
+	bool Lookup(const float3& P, const float3& N, const float3& reflectance, float3& radiance);
+	void Insert(const float3& P, const float3& N, const float3& reflectance, const float3& radiance);
+private:
+	uint64_t Key(const float3& P, const float3& N) const;
+	static uint Slot(uint64_t key) { return (uint)((key * 0x9E3779B97F4A7C15ull) >> 45) & (CACHE_SIZE - 1); }
+public:
+	CacheRecord* records = nullptr;
+	float rcpCellSize = 1;
+	uint frame = 0; // advanced by the main thread between frames
+};
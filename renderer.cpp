@@ -7,6 +7,10 @@ void Renderer::Init()
 	// create fp32 rgb pixel buffer to render to
 	accumulator = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 );
 	memset( accumulator, 0, SCRWIDTH * SCRHEIGHT * 16 );
+	reservoir[0] = new Reservoir[SCRWIDTH * SCRHEIGHT];
+	reservoir[1] = new Reservoir[SCRWIDTH * SCRHEIGHT];
+	gbuffer = new PixelHit[SCRWIDTH * SCRHEIGHT];
+	restirFrame = new float3[SCRWIDTH * SCRHEIGHT];
 
 }
 
@@ -96,7 +100,7 @@ float3 Renderer::Trace(Ray& ray, int depth, float3 energy)
 			Ray r = Ray(ray.IntersectionPoint() + lightRayDirection * 1e-4f ,lightRayDirection, ray.color, sqrt(len2));
 			((diffuse*)m)->scatter(ray, attenuation, scattered, lightRayDirection,
 				scene.lights[i]->GetLightIntensityAt(ray.IntersectionPoint(), ray.hitNormal, pickedPos), ray.hitNormal, energy);
-			if (scene.IsOccluded(r)) continue;
+			if (scene.IsOccludedFromLight(r, i)) continue;
 
 			if (((diffuse*)m)->shinieness != 0)
 				totCol += ((diffuse*)m)->shinieness * m->col * Trace(Ray(ray.IntersectionPoint(), reflect(ray.D, ray.hitNormal), ray.color), depth - 1, energy) * energy;
@@ -154,20 +158,44 @@ float3 Renderer::Sample(Ray& ray, int depth, float3 energy) {
 	switch (m->type)
 	{
 		case DIFFUSE: {
+			// matte surfaces look the same from every side: past the primary
+			// hit their radiance may come from the cache
+			const bool cacheable = scene.useCache && ((diffuse*)m)->shinieness == 0;
+			const float3 reflectance = m->col * m->albedo;
+			const float3 cacheN = dot(normal, ray.D) > 0 ? -normal : normal;
+			if (cacheable && depth <= scene.cacheDepth && scene.cache.Lookup(intersectionPoint, cacheN, reflectance, totCol)) return totCol;
 			float3 directLightning = 0;
 			for (int i = 0; i < size(scene.lights); i++) {
-
-				float3 pickedPos = scene.lights[i]->GetLightPosition();
-				float3 lightRayDirection = pickedPos - ray.IntersectionPoint();
-				float len2 = dot(lightRayDirection, lightRayDirection);
-				lightRayDirection = normalize(lightRayDirection);
-				Ray r = Ray(ray.IntersectionPoint() + lightRayDirection * 1e-4f, lightRayDirection, ray.color, sqrt(len2));
-				if (scene.IsOccluded(r)) continue;
+				// area lights take several stratified samples, traced together
+				// as one shadow packet from the shading point
+				Light* light = scene.lights[i];
+				const int n = light->GetSampleCount();
+				float3 pickedPos[MAX_LIGHT_SAMPLES];
+				Ray r[MAX_LIGHT_SAMPLES];
+				bool occluded[MAX_LIGHT_SAMPLES];
+				for (int s = 0; s < n; s++) {
+					pickedPos[s] = n > 1 ? light->GetLightSample(s, n) : light->GetLightPosition();
+					float3 lightRayDirection = pickedPos[s] - ray.IntersectionPoint();
+					float len2 = dot(lightRayDirection, lightRayDirection);
+					lightRayDirection = normalize(lightRayDirection);
+					r[s] = Ray(ray.IntersectionPoint() + lightRayDirection * 1e-4f, lightRayDirection, ray.color, sqrt(len2));
+				}
+				if (n > 1) scene.IsOccludedPacket(r, n, occluded);
+				else occluded[0] = scene.IsOccludedFromLight(r[0], i);
 				Ray scattered;
-				float3 attenuation;
-				((diffuse*)m)->scatter(ray, attenuation, scattered, lightRayDirection,
-					scene.lights[i]->GetLightIntensityAt(ray.IntersectionPoint(), normal, pickedPos), normal, energy);
-				
+				float3 attenuation = 0, lightEnergy = energy;
+				int visible = 0;
+				for (int s = 0; s < n; s++) {
+					if (occluded[s]) continue;
+					// scatter also updates the energy, the same way for every sample
+					float3 sampleAttenuation, sampleEnergy = energy;
+					((diffuse*)m)->scatter(ray, sampleAttenuation, scattered, r[s].D,
+						light->GetLightIntensityAt(ray.IntersectionPoint(), normal, pickedPos[s]), normal, sampleEnergy);
+					attenuation += sampleAttenuation, lightEnergy = sampleEnergy, visible++;
+				}
+				if (visible == 0) continue;
+				attenuation /= (float)n;
+				energy = lightEnergy;
 
 				if (((diffuse*)m)->shinieness != 0)
 					directLightning += ((diffuse*)m)->shinieness * m->col * Sample(Ray(ray.IntersectionPoint(), reflect(ray.D, ray.hitNormal), ray.color), depth - 1, energy);
@@ -187,6 +215,7 @@ float3 Renderer::Sample(Ray& ray, int depth, float3 energy) {
 
 			indirectLightning /= (float)N;
 			totCol = (directLightning * INVPI + 2 * indirectLightning) * m->albedo;
+			if (cacheable) scene.cache.Insert(intersectionPoint, cacheN, reflectance, totCol);
 			break;
 		}
 		case METAL:{
@@ -234,12 +263,715 @@ float3 Renderer::Sample(Ray& ray, int depth, float3 energy) {
 	}
 	return totCol;
 }
+static inline float PowerHeuristic(float pdfA, float pdfB)
+{
+	return pdfA * pdfA / (pdfA * pdfA + pdfB * pdfB);
+}
+
+static inline float Luminance(const float3& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// Fresnel reflectance of a dielectric as glass::fresnel, for four hits at
+// once and without branches; cosi = dot(I, N) for unit I and N
+static __m128 FresnelDielectric4(__m128 cosi, __m128 ior)
+{
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+	cosi = _mm_min_ps(_mm_max_ps(cosi, _mm_set1_ps(-1)), one);
+	// leaving the glass swaps the indices
+	const __m128 leaving = _mm_cmpgt_ps(cosi, zero);
+	const __m128 etai = _mm_blendv_ps(one, ior, leaving), etat = _mm_blendv_ps(ior, one, leaving);
+	const __m128 sint = _mm_mul_ps(_mm_div_ps(etai, etat), _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(cosi, cosi)))));
+	const __m128 cost = _mm_sqrt_ps(_mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(sint, sint))));
+	const __m128 c = _mm_andnot_ps(_mm_set1_ps(-0.0f), cosi);
+	const __m128 tc = _mm_mul_ps(etat, c), ic = _mm_mul_ps(etai, cost);
+	const __m128 ic2 = _mm_mul_ps(etai, c), tc2 = _mm_mul_ps(etat, cost);
+	const __m128 Rs = _mm_div_ps(_mm_sub_ps(tc, ic), _mm_add_ps(tc, ic));
+	const __m128 Rp = _mm_div_ps(_mm_sub_ps(ic2, tc2), _mm_add_ps(ic2, tc2));
+	const __m128 kr = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(Rs, Rs), _mm_mul_ps(Rp, Rp)), _mm_set1_ps(0.5f));
+	return _mm_blendv_ps(kr, one, _mm_cmpge_ps(sint, one)); // total internal reflection
+}
+
+static inline float FresnelDielectric(float cosi, float ior)
+{
+	float kr[4];
+	_mm_storeu_ps(kr, FresnelDielectric4(_mm_set1_ps(cosi), _mm_set1_ps(ior)));
+	return kr[0];
+}
+
+// continues a path at a glass hit, given its Fresnel reflectance kr:
+// absorption inside the glass, then reflection with probability kr and
+// refraction otherwise
+static void ScatterGlass(Ray& ray, float3& throughput, float kr)
+{
+	const MaterialTable& table = material::Table();
+	const ushort id = ray.matId;
+	const float3 P = ray.IntersectionPoint(), N = ray.hitNormal;
+	bool outside = dot(ray.D, N) < 0;
+	float3 norm = outside ? N : -N, bias = 0.0001f * norm;
+	// absorbed along the path inside the glass
+	const float3& a = table.absorption[id];
+	if (!outside) throughput *= float3(expf(-a.x * ray.t), expf(-a.y * ray.t), expf(-a.z * ray.t));
+	throughput *= table.col[id];
+	if (RandomFloat() < kr) ray = Ray(P + bias, normalize(reflect(ray.D, norm)), ray.color);
+	else
+	{
+		// as glass::RefractRay
+		const float eta = outside ? table.invIr[id] : table.ir[id];
+		float3 perp = eta * (ray.D + min(dot(-ray.D, norm), 1.0f) * norm);
+		ray = Ray(P - bias, normalize(perp - sqrtf(fabsf(1 - dot(perp, perp))) * norm), ray.color);
+	}
+}
+
+// cosine-weighted direction around N, density dot(dir, N) / PI
+static float3 CosineSampleHemisphere(const float3& N)
+{
+	float r = sqrtf(RandomFloat()), phi = TWOPI * RandomFloat();
+	float3 t = normalize(cross(fabs(N.x) > 0.9f ? float3(0, 1, 0) : float3(1, 0, 0), N));
+	float3 b = cross(N, t);
+	return normalize(r * cosf(phi) * t + r * sinf(phi) * b + sqrtf(max(0.0f, 1 - r * r)) * N);
+}
+
+// -----------------------------------------------------------
+// Direct light at a diffuse vertex: scene.lightPicks lights chosen by the
+// light tree, plus one sample towards the sky, each MIS-weighted against
+// the bounce that could have found the same light: cosine-sampled, or
+// drawn from the path guide's mixture guide when that is given. Returns
+// the radiance times cosine over pdf; the caller applies the BRDF.
+// -----------------------------------------------------------
+float3 Renderer::SampleLights(const float3& P, const float3& N, const GuideMixture* guide)
+{
+	float3 Ld = 0;
+	const float picks = (float)scene.lightPicks;
+	for (int s = 0; s < scene.lightPicks; s++)
+	{
+		float pmf;
+		int i = scene.lightTree.Pick(P, N, pmf);
+		if (i < 0) break; // no light faces P
+		Light* light = scene.lights[i];
+		AreaLight* area = dynamic_cast<AreaLight*>(light);
+		float3 y = area ? area->SamplePoint(RandomFloat(), RandomFloat()) : light->GetLightPosition();
+		float3 L = y - P;
+		float dist = length(L);
+		L = L / dist;
+		float cosS = dot(N, L);
+		if (cosS <= 0) continue;
+		Ray shadow(P + L * 1e-4f, L, 0, dist * 0.999f);
+		if (scene.IsOccludedFromLight(shadow, i)) continue;
+		if (area)
+		{
+			float lightPdf = pmf * area->PdfSolidAngle(P, y);
+			if (lightPdf <= 0) continue;
+			float bouncePdf = guide ? scene.guide.Pdf(*guide, L) : cosS * INVPI;
+			Ld += area->Emission() * cosS / (picks * lightPdf) * PowerHeuristic(picks * lightPdf, bouncePdf);
+		}
+		// point-like lights cannot be found by the bounce: no MIS
+		else Ld += light->GetLightIntensityAt(P, N, y) * cosS / (picks * pmf);
+	}
+	float skyPdf;
+	float3 D = scene.SampleSky(skyPdf);
+	float cosS = dot(N, D);
+	if (skyPdf > 0 && cosS > 0)
+	{
+		Ray sky(P + D * 1e-4f, D, 0);
+		float bouncePdf = guide ? scene.guide.Pdf(*guide, D) : cosS * INVPI;
+		if (!scene.IsOccluded(sky)) Ld += scene.GetSkyColor(sky) * cosS / skyPdf * PowerHeuristic(skyPdf, bouncePdf);
+	}
+	return Ld;
+}
+
+// -----------------------------------------------------------
+// Radiance a path collects where it leaves the scene or reaches a light.
+// After a diffuse bounce it is MIS-weighted against the light samples
+// taken at that vertex (prevP, prevN); after a specular one it counts in
+// full.
+// -----------------------------------------------------------
+float3 Renderer::PathEmission(Ray& ray, bool specularBounce, float bsdfPdf, const float3& prevP, const float3& prevN)
+{
+	if (ray.objIdx == -1)
+	{
+		float w = specularBounce ? 1 : PowerHeuristic(bsdfPdf, scene.SkyPdf(ray.D));
+		return scene.GetSkyColor(ray) * w;
+	}
+	AreaLight* light = dynamic_cast<AreaLight*>(scene.lights[ray.objIdx - 11]);
+	if (!light) return 0;
+	if (specularBounce) return light->Emission();
+	float lightPdf = scene.lightPicks * scene.lightTree.Pmf(prevP, prevN, ray.objIdx - 11) *
+		light->PdfSolidAngle(prevP, ray.IntersectionPoint());
+	if (lightPdf > 0) return light->Emission() * PowerHeuristic(bsdfPdf, lightPdf);
+	// else the bounce is the only way to this light: full weight
+	return light->PdfSolidAngle(prevP, ray.IntersectionPoint()) > 0 ? light->Emission() : 0;
+}
+
+// -----------------------------------------------------------
+// Path tracer with next-event estimation: diffuse vertices sample the
+// lights directly (SampleLights), and a bounce that reaches a light or the
+// sky is weighted with the power heuristic against that sample, so direct
+// light is not counted twice. Mirrors and glass cannot sample lights:
+// what they reach counts in full. With scene.useGuiding, diffuse bounces
+// follow the path guide, and the finished path teaches it the radiance
+// found behind each guided bounce. With scene.useCache, matte vertices
+// after the first take their radiance from the radiance cache when it
+// has it, and each matte vertex adds what its path found to the cache.
+// Without lightSamples it is a plain path tracer of the same image: no
+// light samples, and whatever a bounce reaches counts in full.
+// -----------------------------------------------------------
+float3 Renderer::SampleNEE(Ray& ray, int depth, bool firstLights, bool lightSamples)
+{
+	const MaterialTable& table = material::Table();
+	float3 L = 0, throughput = 1;
+	bool specularBounce = true; // the camera counts as one
+	float bsdfPdf = 0;
+	float3 prevP, prevN; // last diffuse vertex, for the light tree's pmf
+	// guided bounces: cell, direction, radiance so far and throughput after
+	struct GuideVertex { int cell; float3 D, L, T; } guided[8];
+	int guidedCount = 0;
+	// matte vertices for the cache: position, normal, reflectance, radiance
+	// so far and throughput on arrival
+	struct CacheVertex { float3 P, N, reflectance, L, T; } matte[8];
+	int matteCount = 0;
+	for (int bounce = 0; bounce <= depth; bounce++)
+	{
+		scene.FindNearest(ray, 0.001f);
+		if (ray.objIdx == -1)
+		{
+			L += throughput * PathEmission(ray, specularBounce || !lightSamples, bsdfPdf, prevP, prevN);
+			break;
+		}
+		if (ray.objIdx >= 11 && ray.objIdx < 11 + size(scene.lights))
+		{
+			// lights reached by the first segment may be counted elsewhere
+			if (bounce > 0 || firstLights) L += throughput * PathEmission(ray, specularBounce || !lightSamples, bsdfPdf, prevP, prevN);
+			break;
+		}
+		float3 P = ray.IntersectionPoint(), N = ray.hitNormal;
+		const ushort id = ray.matId;
+		switch (table.type[id])
+		{
+		case DIFFUSE: {
+			if (dot(N, ray.D) > 0) N = -N;
+			// the shiny part is a mirror, picked with its weight as probability
+			if (RandomFloat() < table.shininess[id])
+			{
+				throughput *= table.col[id];
+				ray = Ray(P + N * 1e-4f, reflect(ray.D, N), ray.color);
+				specularBounce = true;
+				break;
+			}
+			const float3 reflectance = table.col[id] * table.albedo[id], brdf = reflectance * INVPI;
+			if (scene.useCache && table.shininess[id] == 0)
+			{
+				float3 cached;
+				if (bounce > 0 && scene.cache.Lookup(P, N, reflectance, cached))
+				{
+					L += throughput * cached;
+					bounce = depth; // the cache stands in for the rest of the path
+					break;
+				}
+				if (matteCount < 8) matte[matteCount++] = { P, N, reflectance, L, throughput };
+			}
+			const int cell = scene.useGuiding ? scene.guide.Cell(P, N) : -1;
+			GuideMixture mixture;
+			if (cell >= 0) scene.guide.Mixture(cell, N, mixture);
+			if (lightSamples) L += throughput * brdf * SampleLights(P, N, cell < 0 ? nullptr : &mixture);
+			prevP = P, prevN = N;
+			float3 D;
+			if (cell < 0)
+			{
+				D = CosineSampleHemisphere(N);
+				bsdfPdf = dot(D, N) * INVPI;
+				throughput *= brdf * PI; // brdf * cos / pdf
+			}
+			else
+			{
+				D = scene.guide.Sample(mixture, bsdfPdf);
+				float cosD = dot(D, N);
+				if (cosD <= 0 || bsdfPdf <= 0) { bounce = depth; break; } // below the surface: no contribution
+				throughput *= brdf * (cosD / bsdfPdf);
+				if (guidedCount < 8) guided[guidedCount++] = { cell, D, L, throughput };
+			}
+			ray = Ray(P + N * 1e-4f, D, ray.color);
+			specularBounce = false;
+			break;
+		}
+		case METAL:
+			// as metal::scatter
+			throughput *= table.col[id];
+			ray = Ray(P + N * 0.001f, reflect(ray.D, N), ray.color);
+			specularBounce = true;
+			break;
+		case GLASS:
+			ScatterGlass(ray, throughput, FresnelDielectric(dot(normalize(ray.D), normalize(N)), table.ir[id]));
+			specularBounce = true;
+			break;
+		default:
+			bounce = depth; // unknown material: end the path
+			break;
+		}
+		// russian roulette once the path has some length
+		if (bounce > 2)
+		{
+			float p = clamp(max(throughput.x, max(throughput.y, throughput.z)), 0.05f, 1.0f);
+			if (RandomFloat() > p) break;
+			throughput *= 1 / p;
+		}
+	}
+	// what each guided bounce brought in, per unit throughput, is a sample
+	// of the radiance arriving from its direction
+	for (int k = 0; k < guidedCount; k++)
+	{
+		float T = Luminance(guided[k].T);
+		if (T > 0) scene.guide.Update(guided[k].cell, guided[k].D, max(0.0f, Luminance(L - guided[k].L)) / T);
+	}
+	// likewise what each matte vertex passed on is a sample of its radiance
+	for (int k = 0; k < matteCount; k++)
+	{
+		const float3& T = matte[k].T, d = L - matte[k].L;
+		float3 radiance(T.x > 0 ? d.x / T.x : 0, T.y > 0 ? d.y / T.y : 0, T.z > 0 ? d.z / T.z : 0);
+		scene.cache.Insert(matte[k].P, matte[k].N, matte[k].reflectance, radiance);
+	}
+	return L;
+}
+
+// spreads the low 9 bits of x to every third bit, for Morton codes
+static inline uint SpreadBits3(uint x)
+{
+	x &= 0x1ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// sort key of a ray: its direction octant in bits 27-29, so rays that
+// walk the tree in the same child order end up together, then the Morton
+// code of its origin in a 512^3 grid over the scene bounds; origins
+// beyond the bounds share the border cells
+uint Renderer::RayKey(const Ray& ray) const
+{
+	const float3 extent = scene.boundsMax - scene.boundsMin;
+	float3 u = (ray.O - scene.boundsMin) * float3(512 / max(extent.x, 1e-6f), 512 / max(extent.y, 1e-6f), 512 / max(extent.z, 1e-6f));
+	uint x = (uint)clamp((int)u.x, 0, 511), y = (uint)clamp((int)u.y, 0, 511), z = (uint)clamp((int)u.z, 0, 511);
+	uint octant = (ray.D.x < 0) | ((ray.D.y < 0) << 1) | ((ray.D.z < 0) << 2);
+	return (octant << 27) | (SpreadBits3(x) << 2) | (SpreadBits3(y) << 1) | SpreadBits3(z);
+}
+
+// -----------------------------------------------------------
+// Stable LSD radix sort of idx by keys, 8 bits per pass, using keysTmp
+// and idxTmp as scratch. Blocks of the input are counted and scattered in
+// parallel, each into its own range of every digit's bucket; called from
+// within a parallel region, it runs on the calling thread alone.
+// -----------------------------------------------------------
+static void RadixSort(vector<uint>& keys, vector<uint>& idx, vector<uint>& keysTmp, vector<uint>& idxTmp, int bits)
+{
+	const int n = (int)keys.size();
+	const int blocks = clamp(n / 16384, 1, 64);
+	keysTmp.resize(n), idxTmp.resize(n);
+	vector<uint> offset(blocks * 256);
+	for (int shift = 0; shift < bits; shift += 8)
+	{
+		fill(offset.begin(), offset.end(), 0);
+		#pragma omp parallel for schedule(static, 1)
+		for (int b = 0; b < blocks; b++)
+			for (int i = n * b / blocks; i < n * (b + 1) / blocks; i++) offset[b * 256 + ((keys[i] >> shift) & 255)]++;
+		// bucket by bucket, block by block
+		uint sum = 0;
+		for (int d = 0; d < 256; d++) for (int b = 0; b < blocks; b++)
+		{
+			uint count = offset[b * 256 + d];
+			offset[b * 256 + d] = sum, sum += count;
+		}
+		#pragma omp parallel for schedule(static, 1)
+		for (int b = 0; b < blocks; b++)
+			for (int i = n * b / blocks; i < n * (b + 1) / blocks; i++)
+			{
+				uint dst = offset[b * 256 + ((keys[i] >> shift) & 255)]++;
+				keysTmp[dst] = keys[i], idxTmp[dst] = idx[i];
+			}
+		keys.swap(keysTmp), idx.swap(idxTmp);
+	}
+}
+
+// -----------------------------------------------------------
+// Puts count rays in RayKey order: order receives the original index of
+// each ray in sorted order
+// -----------------------------------------------------------
+void Renderer::SortRays(const Ray* rays, uint count, vector<uint>& order)
+{
+	static thread_local vector<uint> keys, keysTmp, orderTmp;
+	keys.resize(count), order.resize(count);
+	for (uint i = 0; i < count; i++) keys[i] = RayKey(rays[i]), order[i] = i;
+	RadixSort(keys, order, keysTmp, orderTmp, 30);
+}
+
+// -----------------------------------------------------------
+// Batched path tracer: the paths advance one bounce at a time. Each bounce
+// finds all hits as one batch, then sorts the hits by material type, so
+// every type is shaded in a single pass reading only its fields of the
+// material table. Same estimator as SampleNEE, without the path guide and
+// the radiance cache. With scene.sortRays, the rays after the first bounce
+// are traced in RayKey order, which keeps similar rays together.
+// -----------------------------------------------------------
+void Renderer::SampleBatch(PathState* path, uint count, int depth)
+{
+	static thread_local vector<Ray> rays;
+	static thread_local vector<uint> active, sorted, order;
+	rays.resize(count), active.resize(count), sorted.resize(count);
+	const MaterialTable& table = material::Table();
+	uint n = count;
+	for (uint i = 0; i < count; i++) active[i] = i;
+	for (int bounce = 0; bounce <= depth && n > 0; bounce++)
+	{
+		if (scene.sortRays && bounce > 0)
+		{
+			for (uint k = 0; k < n; k++) rays[k] = path[active[k]].ray;
+			SortRays(rays.data(), n, order);
+			for (uint k = 0; k < n; k++) sorted[k] = active[order[k]];
+			active.swap(sorted);
+		}
+		for (uint k = 0; k < n; k++) rays[k] = path[active[k]].ray;
+		scene.FindNearestBatch(rays.data(), n);
+		// misses and lights end their paths; the rest are counted by type
+		uint first[5] = {};
+		for (uint k = 0; k < n; k++)
+		{
+			PathState& p = path[active[k]];
+			p.ray = rays[k];
+			if (p.ray.objIdx == -1 || (p.ray.objIdx >= 11 && p.ray.objIdx < 11 + size(scene.lights)))
+			{
+				p.L += p.throughput * PathEmission(p.ray, p.specularBounce, p.bsdfPdf, p.prevP, p.prevN);
+				active[k] = ~0u;
+			}
+			else first[table.type[p.ray.matId] + 1]++;
+		}
+		for (int t = 1; t < 5; t++) first[t] += first[t - 1];
+		uint fill[4] = { first[0], first[1], first[2], first[3] };
+		for (uint k = 0; k < n; k++) if (active[k] != ~0u) sorted[fill[table.type[path[active[k]].ray.matId]]++] = active[k];
+		ShadeDiffuse(path, sorted.data() + first[DIFFUSE], first[DIFFUSE + 1] - first[DIFFUSE]);
+		ShadeMetal(path, sorted.data() + first[METAL], first[METAL + 1] - first[METAL]);
+		ShadeGlass(path, sorted.data() + first[GLASS], first[GLASS + 1] - first[GLASS]);
+		// unknown materials (type 0) end their paths; the rest continue,
+		// with russian roulette once they have some length
+		n = 0;
+		for (uint k = first[1]; k < first[4]; k++)
+		{
+			PathState& p = path[sorted[k]];
+			if (bounce > 2)
+			{
+				float q = clamp(max(p.throughput.x, max(p.throughput.y, p.throughput.z)), 0.05f, 1.0f);
+				if (RandomFloat() > q) continue;
+				p.throughput *= 1 / q;
+			}
+			active[n++] = sorted[k];
+		}
+	}
+}
+
+void Renderer::ShadeDiffuse(PathState* path, const uint* idx, uint count)
+{
+	const MaterialTable& table = material::Table();
+	for (uint k = 0; k < count; k++)
+	{
+		PathState& p = path[idx[k]];
+		const ushort id = p.ray.matId;
+		float3 P = p.ray.IntersectionPoint(), N = p.ray.hitNormal;
+		if (dot(N, p.ray.D) > 0) N = -N;
+		if (RandomFloat() < table.shininess[id])
+		{
+			p.throughput *= table.col[id];
+			p.ray = Ray(P + N * 1e-4f, reflect(p.ray.D, N), p.ray.color);
+			p.specularBounce = true;
+			continue;
+		}
+		const float3 brdf = table.col[id] * table.albedo[id] * INVPI;
+		p.L += p.throughput * brdf * SampleLights(P, N);
+		float3 D = CosineSampleHemisphere(N);
+		p.bsdfPdf = dot(D, N) * INVPI, p.prevP = P, p.prevN = N;
+		p.throughput *= brdf * PI; // brdf * cos / pdf
+		p.ray = Ray(P + N * 1e-4f, D, p.ray.color);
+		p.specularBounce = false;
+	}
+}
+
+void Renderer::ShadeMetal(PathState* path, const uint* idx, uint count)
+{
+	const MaterialTable& table = material::Table();
+	for (uint k = 0; k < count; k++)
+	{
+		PathState& p = path[idx[k]];
+		const float3 P = p.ray.IntersectionPoint(), N = p.ray.hitNormal;
+		p.throughput *= table.col[p.ray.matId];
+		p.ray = Ray(P + N * 0.001f, reflect(p.ray.D, N), p.ray.color);
+		p.specularBounce = true;
+	}
+}
+
+void Renderer::ShadeGlass(PathState* path, const uint* idx, uint count)
+{
+	const MaterialTable& table = material::Table();
+	for (uint k = 0; k < count; k += 4)
+	{
+		// Fresnel for four hits at once; a short last group repeats its
+		// final hit in the empty lanes
+		float cosi[4], ior[4], kr[4];
+		for (uint j = 0; j < 4; j++)
+		{
+			const Ray& r = path[idx[min(k + j, count - 1)]].ray;
+			cosi[j] = dot(normalize(r.D), normalize(r.hitNormal)), ior[j] = table.ir[r.matId];
+		}
+		_mm_storeu_ps(kr, FresnelDielectric4(_mm_loadu_ps(cosi), _mm_loadu_ps(ior)));
+		for (uint j = 0; j < 4 && k + j < count; j++)
+		{
+			PathState& p = path[idx[k + j]];
+			ScatterGlass(p.ray, p.throughput, kr[j]);
+			p.specularBounce = true;
+		}
+	}
+}
+
+// -----------------------------------------------------------
+// One line of the path tracer through SampleBatch, accumulated as the
+// per-pixel loop in Tick does
+// -----------------------------------------------------------
+void Renderer::RenderLineBatched(int y)
+{
+	static thread_local vector<PathState> path;
+	static thread_local vector<float3> totCol;
+	path.resize(SCRWIDTH), totCol.assign(SCRWIDTH, float3(0));
+	if (camera.GetChange()) for (int x = 0; x < SCRWIDTH; ++x) accumulator[x + y * SCRWIDTH] = float3(0);
+	for (int s = 0; s < scene.aaSamples; ++s)
+	{
+		for (int x = 0; x < SCRWIDTH; ++x)
+		{
+			float newX = x + (RandomFloat() * 2 - 1);
+			float newY = y + (RandomFloat() * 2 - 1);
+			PathState& p = path[x];
+			p.ray = camera.GetPrimaryRay(newX, newY);
+			p.L = 0, p.throughput = 1, p.bsdfPdf = 0, p.specularBounce = true;
+		}
+		SampleBatch(path.data(), SCRWIDTH, 4);
+		for (int x = 0; x < SCRWIDTH; ++x)
+		{
+			totCol[x] += path[x].L;
+			float r = pow(totCol[x].x * scene.invAaSamples, GAMMA);
+			float g = pow(totCol[x].y * scene.invAaSamples, GAMMA);
+			float b = pow(totCol[x].z * scene.invAaSamples, GAMMA);
+			accumulator[x + y * SCRWIDTH] += float3(r, g, b);
+		}
+	}
+}
+
+// -----------------------------------------------------------
+// Three estimators of the same image against a SampleNEE reference, at a
+// quarter of the screen resolution: SampleNEE without light samples (BSDF
+// sampling only), SampleNEE with NEE and MIS, and ReSTIR. Sample is left
+// out: its Phong-style lights make a different image. Reports the time to
+// reach a target RMSE, and RMSE after equal time. Meant for
+// instantiateScene1 (select it in the Scene constructor); point-like
+// lights would be missed by BSDF sampling.
+// -----------------------------------------------------------
+void Renderer::MeasureConvergence()
+{
+	const int w = SCRWIDTH / 4, h = SCRHEIGHT / 4, refSpp = 1024;
+	const float target = 0.02f, equalTime = 10, timeLimit = 60;
+	const char* name[3] = { "BSDF only", "NEE+MIS", "ReSTIR" };
+	// one sample per pixel, added to acc
+	auto Render = [&](int method, float3* acc) {
+		if (method == 2)
+		{
+			RenderReSTIR(w, h, 4);
+			for (int i = 0; i < w * h; i++) acc[i] += restirFrame[i];
+			return;
+		}
+		#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x)
+		{
+			Ray ray = camera.GetPrimaryRay(x * 4 + (int)(RandomFloat() * 4), y * 4 + (int)(RandomFloat() * 4));
+			acc[x + y * w] += SampleNEE(ray, 4, true, method == 1);
+		}
+	};
+	vector<float3> reference(w * h, float3(0));
+	for (int s = 0; s < refSpp; s++) Render(1, reference.data());
+	for (float3& c : reference) c = c / (float)refSpp;
+	for (int method = 0; method < 3; method++)
+	{
+		vector<float3> acc(w * h, float3(0));
+		float renderTime = 0, rmse = 1e30f;
+		int spp = 0;
+		scene.timeToRMSE[method] = -1, scene.rmseEqualTime[method] = -1;
+		restirHistory = false;
+		while ((rmse > target || renderTime < equalTime) && renderTime < timeLimit)
+		{
+			Timer t;
+			Render(method, acc.data());
+			renderTime += t.elapsed(), spp++;
+			double err = 0;
+			for (int i = 0; i < w * h; i++)
+			{
+				float3 d = acc[i] / (float)spp - reference[i];
+				err += dot(d, d) / 3;
+			}
+			rmse = (float)sqrt(err / (w * h));
+			if (rmse <= target && scene.timeToRMSE[method] < 0) scene.timeToRMSE[method] = renderTime;
+			if (renderTime >= equalTime && scene.rmseEqualTime[method] < 0) scene.rmseEqualTime[method] = rmse;
+		}
+		printf("%s: RMSE %.4f after %d spp, %.2fs\n", name[method], rmse, spp, renderTime);
+	}
+	restirHistory = false;
+}
+
+// -----------------------------------------------------------
+// Unshadowed direct light from point y on a light, at a primary hit:
+// BRDF times radiance times the geometry term. Its luminance is the
+// target function of the ReSTIR resampling.
+// -----------------------------------------------------------
+float3 Renderer::LightContribution(const PixelHit& hit, int light, const float3& y)
+{
+	float3 L = y - hit.P;
+	float dist2 = dot(L, L);
+	L = L * (1 / sqrtf(dist2));
+	float cosS = dot(hit.N, L);
+	if (cosS <= 0) return 0;
+	if (AreaLight* area = dynamic_cast<AreaLight*>(scene.lights[light]))
+	{
+		float cosL = -dot(normalize(area->normal), L);
+		return cosL > 0 ? hit.brdf * area->Emission() * cosS * cosL / dist2 : 0;
+	}
+	return hit.brdf * scene.lights[light]->GetLightIntensityAt(hit.P, hit.N, y) * cosS;
+}
+
+
+// merge reservoir q, built for another pixel or frame, into r
+void Renderer::CombineReservoir(Reservoir& r, const Reservoir& q, const PixelHit& hit)
+{
+	if (q.light < 0 || q.M == 0) return;
+	float w = Luminance(LightContribution(hit, q.light, q.y)) * q.W * q.M;
+	r.wSum += w, r.M += q.M;
+	if (w > 0 && RandomFloat() * r.wSum < w) r.y = q.y, r.light = q.light;
+}
+
+// -----------------------------------------------------------
+// Direct light by reservoir resampling (ReSTIR), one sample per pixel
+// into restirFrame. Three parallel passes over a w * h grid of pixels,
+// stride screen pixels apart:
+// 1. primary hits, and candidates from the light tree streamed into a
+//    reservoir that is merged with the pixel's reservoir of last frame;
+// 2. merging with the reservoirs of nearby pixels on similar surfaces;
+// 3. one visibility ray per pixel to the chosen sample, plus a path
+//    traced bounce for indirect light.
+// Reuse skips visibility (the biased variant); a sample found occluded
+// in pass 3 is dropped before it can be reused next frame.
+// -----------------------------------------------------------
+void Renderer::RenderReSTIR(int w, int h, int stride)
+{
+	const int candidates = 32, neighbours = 3, radius = 16;
+	Reservoir* prev = reservoir[0], * cur = reservoir[1];
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x)
+	{
+		const int i = x + y * w;
+		PixelHit& hit = gbuffer[i];
+		Ray ray = camera.GetPrimaryRay(x * stride + (int)(RandomFloat() * stride), y * stride + (int)(RandomFloat() * stride));
+		hit.O = ray.O, hit.D = ray.D, hit.valid = false;
+		scene.FindNearest(ray, 0.001f);
+		Reservoir r;
+		material* m = ray.objIdx != -1 && (ray.objIdx < 11 || ray.objIdx >= 11 + size(scene.lights)) ? ray.GetMaterial() : 0;
+		if (m && m->type == DIFFUSE && ((diffuse*)m)->shinieness == 0)
+		{
+			hit.valid = true, hit.t = ray.t;
+			hit.P = ray.IntersectionPoint(), hit.N = dot(ray.hitNormal, ray.D) > 0 ? -ray.hitNormal : ray.hitNormal;
+			hit.brdf = m->col * m->albedo * INVPI;
+			for (int k = 0; k < candidates; k++)
+			{
+				float pmf;
+				int l = scene.lightTree.Pick(hit.P, hit.N, pmf);
+				if (l < 0) { r.M += 1; continue; }
+				AreaLight* area = dynamic_cast<AreaLight*>(scene.lights[l]);
+				float3 yl = area ? area->SamplePoint(RandomFloat(), RandomFloat()) : scene.lights[l]->GetLightPosition();
+				float pdf = area ? pmf / (PI * area->radius2) : pmf;
+				float weight = Luminance(LightContribution(hit, l, yl)) / pdf;
+				r.wSum += weight, r.M += 1;
+				if (weight > 0 && RandomFloat() * r.wSum < weight) r.y = yl, r.light = l;
+			}
+			float pHat = r.light >= 0 ? Luminance(LightContribution(hit, r.light, r.y)) : 0;
+			r.W = pHat > 0 ? r.wSum / (r.M * pHat) : 0;
+			if (restirHistory)
+			{
+				// clamp the history so stale samples cannot dominate
+				Reservoir q = prev[i];
+				q.M = min(q.M, 20.0f * candidates);
+				Reservoir t;
+				CombineReservoir(t, r, hit), CombineReservoir(t, q, hit);
+				pHat = t.light >= 0 ? Luminance(LightContribution(hit, t.light, t.y)) : 0;
+				t.W = pHat > 0 ? t.wSum / (t.M * pHat) : 0;
+				r = t;
+			}
+		}
+		cur[i] = r;
+	}
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x)
+	{
+		const int i = x + y * w;
+		const PixelHit& hit = gbuffer[i];
+		Reservoir r;
+		if (hit.valid)
+		{
+			CombineReservoir(r, cur[i], hit);
+			for (int k = 0; k < neighbours; k++)
+			{
+				int nx = x + (int)((RandomFloat() * 2 - 1) * radius), ny = y + (int)((RandomFloat() * 2 - 1) * radius);
+				if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+				const PixelHit& other = gbuffer[nx + ny * w];
+				if (!other.valid || dot(other.N, hit.N) < 0.9f || fabs(other.t - hit.t) > 0.1f * hit.t) continue;
+				CombineReservoir(r, cur[nx + ny * w], hit);
+			}
+			float pHat = r.light >= 0 ? Luminance(LightContribution(hit, r.light, r.y)) : 0;
+			r.W = pHat > 0 ? r.wSum / (r.M * pHat) : 0;
+		}
+		prev[i] = r;
+	}
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x)
+	{
+		const int i = x + y * w;
+		const PixelHit& hit = gbuffer[i];
+		Reservoir& r = prev[i];
+		float3 color = 0;
+		if (!hit.valid)
+		{
+			Ray ray(hit.O, hit.D, 0);
+			color = SampleNEE(ray, 4);
+		}
+		else
+		{
+			if (r.light >= 0 && r.W > 0)
+			{
+				float3 L = r.y - hit.P;
+				float dist = length(L);
+				L = L / dist;
+				Ray shadow(hit.P + L * 1e-4f, L, 0, dist * 0.999f);
+				if (!scene.IsOccludedFromLight(shadow, r.light)) color += LightContribution(hit, r.light, r.y) * r.W;
+				else r.W = 0;
+			}
+			// indirect light: lights on the bounce's first segment are direct
+			// light, already estimated above
+			float3 D = CosineSampleHemisphere(hit.N);
+			Ray bounce(hit.P + hit.N * 1e-4f, D, 0);
+			color += hit.brdf * PI * SampleNEE(bounce, 3, false);
+		}
+		restirFrame[i] = color;
+	}
+	// the final reservoirs are in prev: that is where the next frame looks
+	restirHistory = true;
+}
+
 // -----------------------------------------------------------
 // Main application tick function - Executed once per frame
 // -----------------------------------------------------------
 void Renderer::Tick(float deltaTime)
 {
 	scene.totIterationNumber++;
+	scene.cache.NextFrame();
 	// animation
 	if (!camera.paused && scene.raytracer) {
 		static float animTime = 0;
@@ -255,40 +987,60 @@ void Renderer::Tick(float deltaTime)
 	}
 	// pixel loop
 	Timer t;
-	// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
-	#pragma omp parallel for schedule(dynamic)
-	for (int y = 0; y < SCRHEIGHT; ++y)
+	if (!scene.raytracer && scene.useReSTIR)
 	{
-		// trace a primary ray for each pixel on the line
-		for (int x = 0; x < SCRWIDTH; ++x) {
-			float3 totCol = float3(0);				//antialiassing
-			for (int s = 0; s < scene.aaSamples; ++s) {
-				if (scene.raytracer) {
-					float newX = x; 
-					float newY = y;
-					totCol += Trace(camera.GetPrimaryRay(newX, newY), 4, float3(1));
-					accumulator[x + y * SCRWIDTH] = (totCol / scene.aaSamples);
-				}
-				else {
-					if (camera.GetChange())	{
-						accumulator[x + y * SCRWIDTH] = float3(0);
+		if (camera.GetChange()) restirHistory = false;
+		RenderReSTIR(SCRWIDTH, SCRHEIGHT, 1);
+		#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < SCRHEIGHT; ++y) for (int dest = y * SCRWIDTH, x = 0; x < SCRWIDTH; ++x)
+		{
+			if (camera.GetChange()) accumulator[x + y * SCRWIDTH] = float3(0);
+			float3 c = restirFrame[x + y * SCRWIDTH];
+			accumulator[x + y * SCRWIDTH] += float3(pow(c.x, GAMMA), pow(c.y, GAMMA), pow(c.z, GAMMA));
+			float4 acc = accumulator[x + y * SCRWIDTH] / it;
+			screen->pixels[dest + x] = RGBF32_to_RGB8(&acc);
+		}
+	}
+	else
+	{
+		// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
+		#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < SCRHEIGHT; ++y)
+		{
+			// trace a primary ray for each pixel on the line
+			if (!scene.raytracer && scene.useNEE && scene.batchShading) RenderLineBatched(y);
+			else for (int x = 0; x < SCRWIDTH; ++x) {
+				float3 totCol = float3(0);				//antialiassing
+				for (int s = 0; s < scene.aaSamples; ++s) {
+					if (scene.raytracer) {
+						float newX = x; 
+						float newY = y;
+						totCol += Trace(camera.GetPrimaryRay(newX, newY), 4, float3(1));
+						accumulator[x + y * SCRWIDTH] = (totCol / scene.aaSamples);
+					}
+					else {
+						if (camera.GetChange())	{
+							accumulator[x + y * SCRWIDTH] = float3(0);
+						}
+						float newX = x + (RandomFloat() * 2 - 1);
+						float newY = y + (RandomFloat() * 2 - 1);
+						if (scene.useNEE) totCol += SampleNEE(camera.GetPrimaryRay(newX, newY), 4);
+						else totCol += Sample(camera.GetPrimaryRay(newX, newY),4, float3(1));
+						float r = pow(totCol.x * scene.invAaSamples, GAMMA);
+						float g = pow(totCol.y * scene.invAaSamples, GAMMA);
+						float b = pow(totCol.z * scene.invAaSamples, GAMMA);
+						accumulator[x + y * SCRWIDTH] += float3(r,g,b);
 					}
-					float newX = x + (RandomFloat() * 2 - 1);
-					float newY = y + (RandomFloat() * 2 - 1);
-					totCol += Sample(camera.GetPrimaryRay(newX, newY),4, float3(1));
-					float r = pow(totCol.x * scene.invAaSamples, GAMMA);
-					float g = pow(totCol.y * scene.invAaSamples, GAMMA);
-					float b = pow(totCol.z * scene.invAaSamples, GAMMA);
-					accumulator[x + y * SCRWIDTH] += float3(r,g,b);
 				}
 			}
-		}
-		// translate accumulator contents to rgb32 pixels
-		for (int dest = y * SCRWIDTH, x = 0; x < SCRWIDTH; ++x)	{
-			float4 acc = accumulator[x + y * SCRWIDTH] / it; /// iteration;
-			screen->pixels[dest + x] = (RGBF32_to_RGB8(&acc));///iteration ;
+			// translate accumulator contents to rgb32 pixels
+			for (int dest = y * SCRWIDTH, x = 0; x < SCRWIDTH; ++x)	{
+				float4 acc = accumulator[x + y * SCRWIDTH] / it; /// iteration;
+				screen->pixels[dest + x] = (RGBF32_to_RGB8(&acc));///iteration ;
+			}
 		}
 	}
+	if (scene.guideDebug) DrawGuideDebug();
 	
 	if (!scene.raytracer && !camera.GetChange())
 		scene.SetIterationNumber(it + 1);
@@ -300,7 +1052,240 @@ void Renderer::Tick(float deltaTime)
 	float fps = 1000 / avg, rps = (SCRWIDTH * SCRHEIGHT) * fps;
 	scene.SetFPS(fps);
 	scene.runTime += t.elapsed();
+	// the benchmarks are heavy (the TLAS one builds a million instances):
+	// they only run on the B key, this export leaves their rows at 0
 	if (scene.runTime > 20 && !scene.exported) scene.ExportData();
 	printf( "%5.2fms (%.1ffps) - %.1fMrays/s %.1fCameraSpeed\n", avg, fps, rps / 1000000, camera.speed );
 }
+// -----------------------------------------------------------
+// Path guide debug view: the learned distribution of the cell under the
+// mouse, drawn top left as a grid of its direction bins (rows are bands
+// from -z up to +z, columns sectors in phi). Brightness is the bin's
+// Q-value relative to the largest; bins the cell never samples, as they
+// lie below its surface, are dark red.
+// -----------------------------------------------------------
+void Renderer::DrawGuideDebug()
+{
+	Ray ray = camera.GetPrimaryRay(mousePos.x, mousePos.y);
+	scene.FindNearest(ray, 0.001f);
+	if (ray.objIdx == -1) return;
+	float3 N = ray.hitNormal;
+	if (dot(N, ray.D) > 0) N = -N;
+	const int cell = scene.guide.Cell(ray.IntersectionPoint(), N);
+	float qMax = 1e-6f;
+	for (int k = 0; k < GUIDE_BINS; k++) qMax = max(qMax, scene.guide.Q(cell, k));
+	const int size = 16;
+	for (int k = 0; k < GUIDE_BINS; k++)
+	{
+		uint c = 0x400000;
+		if (dot(pathGuide::BinCenter(k), N) > -0.4f)
+		{
+			uint v = (uint)(255 * clamp(scene.guide.Q(cell, k) / qMax, 0.0f, 1.0f));
+			c = (v << 16) | (v << 8) | v;
+		}
+		int x0 = (k % GUIDE_SECTORS) * size, y0 = (GUIDE_BANDS - 1 - k / GUIDE_SECTORS) * size;
+		for (int y = y0; y < y0 + size - 1; y++) for (int x = x0; x < x0 + size - 1; x++)
+			screen->pixels[x + y * SCRWIDTH] = c;
+	}
+}
+// -----------------------------------------------------------
+// Time the primary rays of a frame through the per-ray kernel and
+// through the interleaved batch kernel; the gap grows with the mesh,
+// as less of the node array fits in cache
+// -----------------------------------------------------------
+void Renderer::BenchmarkBatchTraversal()
+{
+	vector<Ray> rays(SCRWIDTH * SCRHEIGHT);
+	for (int y = 0; y < SCRHEIGHT; ++y) for (int x = 0; x < SCRWIDTH; ++x)
+		rays[x + y * SCRWIDTH] = camera.GetPrimaryRay(x, y);
+	vector<Ray> batch = rays;
+	Timer t;
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y)
+		for (int x = 0; x < SCRWIDTH; ++x) scene.FindNearest(rays[x + y * SCRWIDTH], 1e-6f);
+	float single = t.elapsed();
+	t.reset();
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y) scene.FindNearestBatch(&batch[y * SCRWIDTH], SCRWIDTH);
+	float batched = t.elapsed();
+	scene.batchSpeedup = single / batched;
+	printf("per-ray %.2fms, batched %.2fms (%.2fx)\n", single * 1000, batched * 1000, scene.batchSpeedup);
+}
+// -----------------------------------------------------------
+// Closest-hit and shadow-ray throughput, measured apart: primary
+// rays first, then one shadow ray per light from each hit, without
+// and with the per-light occluder cache
+// -----------------------------------------------------------
+void Renderer::BenchmarkShadowRays()
+{
+	vector<Ray> rays(SCRWIDTH * SCRHEIGHT);
+	for (int y = 0; y < SCRHEIGHT; ++y) for (int x = 0; x < SCRWIDTH; ++x)
+		rays[x + y * SCRWIDTH] = camera.GetPrimaryRay(x, y);
+	Timer t;
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y)
+		for (int x = 0; x < SCRWIDTH; ++x) scene.FindNearest(rays[x + y * SCRWIDTH], 1e-6f);
+	scene.closestHitRate = rays.size() / (t.elapsed() * 1e6f);
+	// shadow rays in pixel order, so neighbours stay together per thread
+	vector<Ray> shadow;
+	vector<uint> light;
+	for (Ray& ray : rays) if (ray.objIdx != -1) for (int i = 0; i < size(scene.lights); i++)
+	{
+		float3 P = ray.IntersectionPoint(), L = scene.lights[i]->GetLightPosition() - P;
+		float dist = length(L);
+		L = L / dist;
+		shadow.push_back(Ray(P + L * 1e-4f, L, ray.color, dist));
+		light.push_back(i);
+	}
+	if (shadow.empty()) return;
+	vector<Ray> cached = shadow;
+	const int count = (int)shadow.size();
+	t.reset();
+	#pragma omp parallel for schedule(static, 1024)
+	for (int i = 0; i < count; ++i) scene.IsOccluded(shadow[i]);
+	scene.shadowRate = count / (t.elapsed() * 1e6f);
+	t.reset();
+	#pragma omp parallel for schedule(static, 1024)
+	for (int i = 0; i < count; ++i) scene.IsOccludedFromLight(cached[i], light[i]);
+	scene.shadowCachedRate = count / (t.elapsed() * 1e6f);
+	printf("closest-hit %.1fMrays/s, shadow %.1fMrays/s, cached shadow %.1fMrays/s\n",
+		scene.closestHitRate, scene.shadowRate, scene.shadowCachedRate);
+}
 
+// set-associative LRU cache of 64-byte lines, as a typical 32KB L1: to
+// compare the locality of ray orders without hardware counters
+struct CacheSim
+{
+	static const int SETS = 64, WAYS = 8;
+	uint64_t line[SETS][WAYS] = {};
+	uint lastUse[SETS][WAYS] = {};
+	uint clock = 0, hits = 0, accesses = 0;
+	void Access(const void* p)
+	{
+		const uint64_t l = (uint64_t)p >> 6;
+		const int set = (int)(l % SETS);
+		int victim = 0;
+		accesses++, clock++;
+		for (int w = 0; w < WAYS; w++)
+		{
+			if (line[set][w] == l + 1) { hits++, lastUse[set][w] = clock; return; }
+			if (lastUse[set][w] < lastUse[set][victim]) victim = w;
+		}
+		line[set][victim] = l + 1, lastUse[set][victim] = clock;
+	}
+	float HitRate() const { return accesses ? (float)hits / accesses : 0; }
+};
+
+// -----------------------------------------------------------
+// First-bounce rays of a frame, scattered by material as SampleBatch does,
+// and traced as SampleBatch traces them: one batch per screen line, in
+// pixel order and in RayKey order (sort included). MRays/s for each, and
+// the hit rate of a simulated L1 cache over the nodes each order fetches,
+// as one thread would in sequence
+// -----------------------------------------------------------
+void Renderer::BenchmarkSecondaryRays()
+{
+	const MaterialTable& table = material::Table();
+	vector<Ray> primary(SCRWIDTH * SCRHEIGHT), rays;
+	vector<uint> lineFirst(SCRHEIGHT + 1); // each line's first ray
+	for (int y = 0; y < SCRHEIGHT; ++y) for (int x = 0; x < SCRWIDTH; ++x)
+		primary[x + y * SCRWIDTH] = camera.GetPrimaryRay(x, y);
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y)
+		for (int x = 0; x < SCRWIDTH; ++x) scene.FindNearest(primary[x + y * SCRWIDTH], 1e-6f);
+	for (int y = 0; y < SCRHEIGHT; ++y)
+	{
+		lineFirst[y] = (uint)rays.size();
+		for (int x = 0; x < SCRWIDTH; ++x)
+		{
+			Ray& ray = primary[x + y * SCRWIDTH];
+			if (ray.objIdx == -1 || (ray.objIdx >= 11 && ray.objIdx < 11 + size(scene.lights))) continue;
+			const float3 P = ray.IntersectionPoint();
+			float3 N = ray.hitNormal, throughput = 1;
+			switch (table.type[ray.matId])
+			{
+			case DIFFUSE:
+				if (dot(N, ray.D) > 0) N = -N;
+				rays.push_back(Ray(P + N * 1e-4f, CosineSampleHemisphere(N), ray.color));
+				break;
+			case METAL:
+				rays.push_back(Ray(P + N * 0.001f, reflect(ray.D, N), ray.color));
+				break;
+			case GLASS:
+				ScatterGlass(ray, throughput, FresnelDielectric(dot(normalize(ray.D), normalize(N)), table.ir[ray.matId]));
+				rays.push_back(ray);
+				break;
+			}
+		}
+	}
+	lineFirst[SCRHEIGHT] = (uint)rays.size();
+	if (rays.empty()) return;
+	const int count = (int)rays.size();
+	vector<Ray> trace = rays;
+	Timer t;
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y)
+		scene.FindNearestBatch(trace.data() + lineFirst[y], lineFirst[y + 1] - lineFirst[y]);
+	scene.secondaryRate[0] = count / (t.elapsed() * 1e6f);
+	t.reset();
+	vector<uint> sortedIdx(count); // frame-wide index of each sorted ray
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; ++y)
+	{
+		static thread_local vector<uint> order;
+		const uint first = lineFirst[y], n = lineFirst[y + 1] - first;
+		SortRays(rays.data() + first, n, order);
+		for (uint k = 0; k < n; k++) trace[first + k] = rays[first + order[k]], sortedIdx[first + k] = first + order[k];
+		scene.FindNearestBatch(trace.data() + first, n);
+	}
+	scene.secondaryRate[1] = count / (t.elapsed() * 1e6f);
+	// the simulation walks the scene's own bvh, binary or QBVH
+	if (!scene.useTLAS) for (int sorted = 0; sorted < 2; sorted++)
+	{
+		CacheSim cache;
+		vector<uint> visited;
+		for (int i = 0; i < count; ++i)
+		{
+			Ray ray = rays[sorted ? sortedIdx[i] : i];
+			visited.clear();
+			scene.b->IntersectRecord(ray, visited);
+			for (uint v : visited) cache.Access(&scene.b->bvhNode[v]);
+		}
+		scene.secondaryHitRate[sorted] = cache.HitRate();
+	}
+	printf("secondary %.1fMrays/s unsorted, %.1fMrays/s sorted; L1 hit rate %.3f unsorted, %.3f sorted\n",
+		scene.secondaryRate[0], scene.secondaryRate[1], scene.secondaryHitRate[0], scene.secondaryHitRate[1]);
+}
+// -----------------------------------------------------------
+// TLAS build time at scale: a million randomly placed and rotated
+// instances of one of the scene's BVHs, timed through tlas::build
+// -----------------------------------------------------------
+void Renderer::BenchmarkTLASBuild()
+{
+	// nested scenes instance whole TLASes: descend to the first real BLAS
+	bvh* blas = scene.useTLAS ? nullptr : scene.b;
+	for (tlas* level = scene.useTLAS ? scene.tl : nullptr; level && !blas;)
+	{
+		tlas* sub = nullptr;
+		for (uint i = 0; i < level->blasCount && !blas; i++)
+			if (level->blas[i].bvh) blas = level->blas[i].bvh;
+			else if (!sub) sub = level->blas[i].tl;
+		level = sub;
+	}
+	if (!blas) return;
+	const int count = 1000000;
+	bvhInstance* instances = new bvhInstance[count];
+	for (int i = 0; i < count; i++)
+	{
+		float3 P = float3(RandomFloat(), RandomFloat(), RandomFloat()) * 1000 - 500;
+		instances[i] = bvhInstance(blas);
+		instances[i].SetTransform(mat4::Translate(P) * mat4::RotateY(RandomFloat() * TWOPI));
+	}
+	Timer t;
+	tlas* tl = new tlas(instances, count);
+	tl->build();
+	scene.tlasBuildTime1M = t.elapsed() * 1000;
+	printf("TLAS build %.1fms (1M instances)\n", scene.tlasBuildTime1M);
+	delete tl;
+	delete[] instances;
+}
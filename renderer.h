@@ -2,6 +2,33 @@
 #include <iostream>
 namespace Tmpl8
 {
+	// per-pixel ReSTIR reservoir: one light sample kept from a stream of
+	// candidates, with the running weight sum, candidate count and the
+	// resulting contribution weight W (an estimate of 1 / pdf)
+	struct Reservoir
+	{
+		float3 y; // point on the light
+		int light = -1;
+		float wSum = 0, M = 0, W = 0;
+	};
+	// primary hit of a pixel, kept between the ReSTIR passes
+	struct PixelHit
+	{
+		float3 O, D; // primary ray
+		float3 P, N, brdf;
+		float t;
+		bool valid; // plain diffuse hit: other pixels are path traced
+	};
+	// path of the batched integrator, see Renderer::SampleBatch; the
+	// fields follow the locals of SampleNEE
+	struct PathState
+	{
+		Ray ray;
+		float3 L, throughput;
+		float3 prevP, prevN;
+		float bsdfPdf;
+		bool specularBounce;
+	};
 
 	class Renderer : public TheApp
 	{
@@ -10,7 +37,26 @@ namespace Tmpl8
 		void Init();
 		float3 Trace(Ray& ray, int depth, float3 energy);
 		float3 Sample(Ray& ray, int depth, float3 energy);
+		float3 SampleNEE(Ray& ray, int depth, bool firstLights = true, bool lightSamples = true);
+		float3 SampleLights(const float3& P, const float3& N, const GuideMixture* guide = nullptr);
+		float3 PathEmission(Ray& ray, bool specularBounce, float bsdfPdf, const float3& prevP, const float3& prevN);
+		void SampleBatch(PathState* path, uint count, int depth);
+		void ShadeDiffuse(PathState* path, const uint* idx, uint count);
+		void ShadeMetal(PathState* path, const uint* idx, uint count);
+		void ShadeGlass(PathState* path, const uint* idx, uint count);
+		void RenderLineBatched(int y);
+		uint RayKey(const Ray& ray) const;
+		void SortRays(const Ray* rays, uint count, vector<uint>& order);
+		void MeasureConvergence();
+		void RenderReSTIR(int w, int h, int stride);
+		float3 LightContribution(const PixelHit& hit, int light, const float3& y);
+		void CombineReservoir(Reservoir& r, const Reservoir& q, const PixelHit& hit);
 		void Tick(float deltaTime);
+		void BenchmarkBatchTraversal();
+		void BenchmarkShadowRays();
+		void BenchmarkSecondaryRays();
+		void BenchmarkTLASBuild();
+		void DrawGuideDebug();
 		void Shutdown() { /* implement if you want to do something on exit */ }
 		// input handling
 		void MouseUp(int button) {
@@ -87,7 +133,32 @@ namespace Tmpl8
 				majPressed = true;
 				camera.transferYZ();
 				break;
+			case KEYBOARD_M:
+				MeasureConvergence();
+				break;
+			case KEYBOARD_G:
+				scene.useGuiding = !scene.useGuiding;
+				camera.SetChange(true);
+				break;
+			case KEYBOARD_V:
+				scene.guideDebug = !scene.guideDebug;
+				break;
+			case KEYBOARD_C:
+				scene.useCache = !scene.useCache;
+				camera.SetChange(true);
+				break;
+			case KEYBOARD_L:
+				scene.batchShading = !scene.batchShading;
+				camera.SetChange(true);
+				break;
+			case KEYBOARD_O:
+				scene.sortRays = !scene.sortRays;
+				break;
 			case KEYBOARD_B:
+				BenchmarkBatchTraversal();
+				BenchmarkShadowRays();
+				BenchmarkSecondaryRays();
+				BenchmarkTLASBuild();
 				scene.ExportData();
 			}
 			/* implement if you want to handle keys */
@@ -96,12 +167,24 @@ namespace Tmpl8
 		int2 mousePos;
 		bool mousePressed = false;
 		float4* accumulator;
+		// ReSTIR state, see RenderReSTIR: the reservoirs of the last frame
+		// feed the next one while restirHistory holds
+		Reservoir* reservoir[2];
+		PixelHit* gbuffer;
+		float3* restirFrame;
+		bool restirHistory = false;
 		Scene scene;
 		Camera camera;
 		float2 xBox = float2(-1, 1), yBox = float2(-1, 1), zBox = float2(-1, 1);	//makeboudningbox
 		bool majPressed = false;
 		enum UserInput {
 			KEYBOARD_B = 66,
+			KEYBOARD_C = 67,
+			KEYBOARD_G = 71,
+			KEYBOARD_V = 86,
+			KEYBOARD_L = 76,
+			KEYBOARD_M = 77,
+			KEYBOARD_O = 79,
 			KEYBOARD_W = 87,
 			KEYBOARD_D = 68,
 			KEYBOARD_S = 83,
@@ -15,6 +15,7 @@
 #include <string>
 #include <sstream>
 #include <thread>
+#include <atomic>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -1531,6 +1532,9 @@ public:
 #include "bvh.h"
 #include "bvhInstance.h"
 #include "tlas.h"
+#include "lightBVH.h"
+#include "pathGuide.h"
+#include "radianceCache.h"
 #include "DataCollector.h"
 
 // InstructionSet.cpp
@@ -28,7 +28,7 @@ namespace Tmpl8 {
 	class material;
 	class diffuse;
 	class metal;
-	class Triangle;
+	class Mesh;
 	class DataCollector;
 	enum MAT_TYPE {
 		DIFFUSE = 1,
@@ -50,10 +50,11 @@ namespace Tmpl8 {
 #endif
 		}
 		float3 IntersectionPoint() const { return O + t * D; }
-		void SetMaterial(material* mat) { m = mat; }
-		material* GetMaterial() { return m; }
+		void SetMaterial(material* mat);
+		material* GetMaterial() const;
 		void SetNormal(float3 normal) {
 			hitNormal = normal;
+			hitMesh = 0;
 		}
 		// ray data
 #ifndef SPEEDTRIX
@@ -69,9 +70,139 @@ namespace Tmpl8 {
 		bool exists = false;
 		float3 color = 0;
 		float3 hitNormal;
-		material* m;
+		ushort matId = 0; // into material::Table()
+		// mesh hits are resolved lazily: only the mesh and face are recorded
+		// during traversal, normal and material are fetched for the final hit.
+		const Mesh* hitMesh = 0;
+		uint hitFace = 0;
+		uint occluder = 0; // leaf that ended a shadow ray, see bvh::IsOccludedCached
 	};
 
+	// shading parameters of every material, one array per field, indexed by
+	// the material's 16-bit id: hits carry the id, and shading reads only
+	// the fields it needs. Materials add themselves on construction.
+	struct MaterialTable
+	{
+		vector<uchar> type;
+		vector<float3> col, albedo, absorption;
+		vector<float> shininess, ir, invIr;
+		vector<material*> object; // the material itself, for its scatter methods
+		ushort Add(material* m)
+		{
+			// entries are never freed: share materials rather than make one per object
+			FATALERROR_IF(object.size() > 0xFFFF, "more than %d materials: ids are 16 bits", 0x10000);
+			type.push_back(0), col.push_back(0), albedo.push_back(0), absorption.push_back(0);
+			shininess.push_back(0), ir.push_back(1), invIr.push_back(1);
+			object.push_back(m);
+			return (ushort)(object.size() - 1);
+		}
+	};
+
+	class material {
+	public:
+		material(float3 c, bool rt) : col(c), raytracer(rt) { id = Table().Add(this); Table().col[id] = c; }
+		static MaterialTable& Table() { static MaterialTable table; return table; }
+
+		void SetColor(float3 c) { col = c; Table().col[id] = c; }
+		float3 col, albedo = 0, emission = 0;
+		int type;
+		bool raytracer;
+		ushort id; // into Table()
+	};
+
+	
+	class diffuse : public material {
+	public:
+		diffuse(float3 a = 0, float3 c = 0, float ks = 0.2, float kd = 0.8, int n = 2, bool rt = true, float e = 0, float s = 0)
+			: specu(ks), diffu(kd), N(n), material(c, rt) {
+			type = DIFFUSE;
+			albedo = a;
+			emission = e;
+			shinieness = s;
+			MaterialTable& t = Table();
+			t.type[id] = DIFFUSE, t.albedo[id] = a, t.shininess[id] = s;
+		}
+		void SetSpecularity(float ks) { specu = ks; }
+		void SetDiffuse(float kd) { diffu = kd; }
+		void SetN(int n) { N = n; }
+		virtual bool scatter(const Ray& ray, float3& att, Ray& scattered,  float3 lightDir, float3 lightIntensity, float3 normal, float3& energy) {
+			float3 reflectionDirection = reflect(-lightDir, normal);
+			float3 specularColor, lightAttenuation;
+			specularColor = powf(fmax(0.0f, -dot(reflectionDirection, ray.D)), N) * lightIntensity;
+			lightAttenuation = lightIntensity;
+			att = albedo * lightAttenuation * diffu + specularColor * specu;
+			float3 dir;
+			if (!raytracer) {
+				dir = RandomInHemisphere(normal);
+			}
+			scattered = Ray(ray.IntersectionPoint(), dir, ray.color);
+			float3 retention = float3(1) - albedo;
+			float3 newEnergy(energy - retention);
+			energy = newEnergy.x > 0 ? newEnergy : 0;
+			return true;
+		}
+
+	public:
+		float specu, diffu, shinieness;
+		int N;
+	};
+
+	class metal : public material {
+	public:
+		metal(float f, float3 c, bool rt) : fuzzy(f < 1 ? f : 1), material(c, rt) { type = METAL; emission = 0; Table().type[id] = METAL; }
+		virtual bool scatter(const Ray& ray, Ray& reflected, float3 normal, float3& energy) {
+			float3 dir = reflect(ray.D, normal);
+			reflected = Ray(ray.IntersectionPoint() + normal * 0.001f, dir, ray.color * col);
+			energy = energy;
+			return dot(reflected.D, normal) > 0;
+		}
+
+	public:
+		float fuzzy;
+	};
+
+	class glass : public material{
+	public: 
+		glass(float refIndex, float3 c, float3 a, float r, float n, bool rt)
+			: ir(refIndex), absorption(a), specu(r), N(n), material(c, rt) {
+			type = GLASS; invIr = 1 / ir;
+			MaterialTable& t = Table();
+			t.type[id] = GLASS, t.ir[id] = ir, t.invIr[id] = invIr, t.absorption[id] = a;
+		}
+		void fresnel(const float3& I, const float3& N, const float& ior, float& kr)
+		{
+			float cosi = clamp(dot(I, N) ,-1.0f, 1.0f);
+			float etai = 1, etat = ior;				 
+			if (cosi > 0) { std::swap(etai, etat); }
+			float sint = etai / etat * sqrtf(fmaxf(0.f, 1 - cosi * cosi));
+			// Total internal reflection
+			if (sint >= 1) {
+				kr = 1;
+			}
+			else {
+				float cost = sqrtf(fmaxf(0.f, 1 - sint * sint));
+				cosi = fabsf(cosi);
+				float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+				float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+				kr = (Rs * Rs + Rp * Rp) / 2;
+			}
+			// As a consequence of the conservation of energy, transmittance is given by:
+			// kt = 1 - kr;
+		}
+		float3 RefractRay(const float3& oRayDir, const float3& normal, const float& refRatio) {
+			float theta = fmin(dot(-oRayDir, normal), 1.0);	  
+			float3 perpendicular = refRatio * (oRayDir + theta * normal);
+			float3	parallel = -sqrt(fabs(1.0 - pow(length(perpendicular), 2))) * normal;
+			return perpendicular + parallel;									  
+		}
+
+		float ir, fresnelVal, specu, N, invIr;
+		float3 absorption;
+	};
+
+	inline material* Ray::GetMaterial() const { return material::Table().object[matId]; }
+	inline void Ray::SetMaterial(material* mat) { matId = mat->id; }
+
 	class Light {
 	public:
 		Light() = default;
@@ -79,6 +210,9 @@ namespace Tmpl8 {
 			: objIdx(idx), pos(p), strength(str), col(c), normal(n), raytracer(rt) {}
 		float3 GetNormal() { return normal; }
 		virtual float3 GetLightPosition() { return pos; }
+		// sample stratum of strata on the light, see AreaLight
+		virtual float3 GetLightSample(int stratum, int strata) { return GetLightPosition(); }
+		virtual int GetSampleCount() const { return 1; }
 		float3 GetLightColor() { return col; }
 		virtual float3 GetLightIntensityAt(float3 p, float3 n, float3 from) { return 1; }
 		virtual void Intersect (Ray& ray, float t_min) { return; }
@@ -91,6 +225,8 @@ namespace Tmpl8 {
 		float3 normal;
 	};
 
+#define MAX_LIGHT_SAMPLES 16 // shadow rays per light per shading point
+
 	class AreaLight : public Light {
 	public:
 		AreaLight() = default;
@@ -106,7 +242,7 @@ namespace Tmpl8 {
 			float d = dot(normal, ray.D);
 			float3 dir = pos - ray.O;
 			float t = dot(dir, normal) / d;
-				if (t >= t_min) {
+				if (t >= t_min && t < ray.t) {
 					float3 intersection = ray.O +ray.D * t;
 					float3 v = intersection - pos;
 					float dis2 = dot(v, v);
@@ -117,6 +253,12 @@ namespace Tmpl8 {
 			}
 
 
+		}
+		void Bounds(float3& bmin, float3& bmax) const {
+			// a disc extends r * sqrt(1 - n_i^2) along axis i
+			float3 n = normalize(normal);
+			float3 e = radius * float3(sqrtf(max(0.0f, 1 - n.x * n.x)), sqrtf(max(0.0f, 1 - n.y * n.y)), sqrtf(max(0.0f, 1 - n.z * n.z)));
+			bmin = pos - e, bmax = pos + e;
 		}
 		float3 GetLightIntensityAt(float3 p, float3 n, float3 from) override {
 			float dis = length(from - p);
@@ -129,11 +271,36 @@ namespace Tmpl8 {
 		}
 
 
+		// point on the disc for (u, v) in [0,1)^2, uniform in area and in the
+		// plane given by the light's normal
+		float3 SamplePoint(float u, float v) const {
+			float3 n = normalize(normal);
+			float3 t = normalize(cross(fabs(n.x) > 0.9f ? float3(0, 1, 0) : float3(1, 0, 0), n));
+			float3 b = cross(n, t);
+			float r = radius * sqrtf(u), theta = 2 * PI * v;
+			return pos + r * (cosf(theta) * t + sinf(theta) * b);
+		}
 		float3 GetLightPosition() override {
 			if (raytracer) return pos;
-			float newRad = radius * sqrt(RandomFloat());
-			float theta = RandomFloat() * 2 * PI;
-			return float3(pos.x + newRad * cos(theta), pos.y + newRad * sin(theta), pos.z);
+			return SamplePoint(RandomFloat(), RandomFloat());
+		}
+		// one jittered cell of a gx * gy grid over (u, v), gx * gy == strata
+		float3 GetLightSample(int stratum, int strata) override {
+			if (raytracer) return pos;
+			int gx = max(1, (int)sqrtf((float)strata));
+			while (strata % gx) gx--;
+			int gy = strata / gx;
+			return SamplePoint((stratum % gx + RandomFloat()) / gx, (stratum / gx + RandomFloat()) / gy);
+		}
+		int GetSampleCount() const override { return raytracer ? 1 : min(samples, MAX_LIGHT_SAMPLES); }
+		// emitted radiance: strength spread over the disc, towards the normal
+		float3 Emission() const { return strength * col / (PI * radius2); }
+		// solid-angle density of sampling point y with SamplePoint, seen from P
+		float PdfSolidAngle(const float3& P, const float3& y) const {
+			float3 d = y - P;
+			float dist2 = dot(d, d);
+			float cosL = -dot(d, normalize(normal)) / sqrtf(dist2);
+			return cosL > 0 ? dist2 / (cosL * PI * radius2) : 0;
 		}
 		int samples;
 		float radius, radius2;
@@ -167,93 +334,12 @@ namespace Tmpl8 {
 		float sinAngle;
 	};
 	
-	// -----------------------------------------------------------
-	// Triangle Primitive
-	// 
-	// 
-	// -----------------------------------------------------------
-	class Triangle {
-	public:
-		Triangle() = default;
-		Triangle(int idx, material* m, float3 ver0, float3 ver1, float3 ver2) : objIdx(idx), v0(ver0), v1(ver1), v2(ver2), mat(m) {
-			e1 = v1 - v0;
-			e2 = v2 - v0;
-			N = normalize(cross(e1, e2));
-			centroid = (v0 + v1 + v2) * 0.333f;
-		}
-		Triangle(int idx, material* m, int3 facesIdx, vector<float3> vertices) : objIdx(idx), v0(vertices[facesIdx.x]), v1(vertices[facesIdx.y]), v2(vertices[facesIdx.z]), mat(m) {
-			e1 = v1 - v0;
-			e2 = v2 - v0;
-			N = normalize(cross(e1, e2));
-			centroid = (v0 + v1 + v2) * 0.333f;
-		}
-		void Intersect(Ray& ray, float t_min) const {		 //scratchapixel implementation
-			float NdotRayDir = dot(N, ray.D);
-			if (fabs(NdotRayDir) < t_min) return;
-			float d = -dot(N, v0);
-			float t = -(dot(N, ray.O) + d) / NdotRayDir;
-			if (t < 0) return;
-			float3 p = ray.O + t * ray.D;
-			float3 c ;
-
-			float3 vp0 = p - v0;
-			c = cross(e1, vp0);
-			if (dot(N, c) < 0) return ;
-			float3 vp1 = p - v1;
-			float3 e3 = v2 - v1;
-			c = cross(e3, vp1);
-			if (dot(N, c) < 0) return;
-			float3 e4 = v0 - v2;
-			float3 vp2 = p - v2;
-			c = cross(e4, vp2);
-			if (dot(N, c) < 0) return;
-
-			if (t < ray.t && t > t_min) {
-				ray.t = t, ray.objIdx = objIdx, ray.m = mat,
-					ray.SetNormal(N);
-			}
-		}
-		bool IsOccluding(Ray& ray, float t_min) const {		 //scratchapixel implementation
-			float NdotRayDir = dot(N, ray.D);
-			if (fabs(NdotRayDir) < t_min) return false;
-			float d = -dot(N, v0);
-			float t = -(dot(N, ray.O) + d) / NdotRayDir;
-			if (t < 0) return false;
-			float3 p = ray.O + t * ray.D;
-			float3 c;
-
-			float3 vp0 = p - v0;
-			c = cross(e1, vp0);
-			if (dot(N, c) < 0) return false;
-			float3 vp1 = p - v1;
-			float3 e3 = v2 - v1;
-			c = cross(e3, vp1);
-			if (dot(N, c) < 0) return false;
-			float3 e4 = v0 - v2;
-			float3 vp2 = p - v2;
-			c = cross(e4, vp2);
-			if (dot(N, c) < 0) return false;
-			if (t < ray.t && t > t_min) return true;
-		}
-		void update(int3 faces, vector<float3> vertices) {
-			v0 = vertices[faces.x];
-			v1 = vertices[faces.y];
-			v2 = vertices[faces.z];
-			e1 = v1 - v0;
-			e2 = v2 - v0;
-			N = normalize(cross(e1, e2));
-			centroid = (v0 + v1 + v2) * 0.333f;
-		}
-		float3 GetNormal(const float3 I) const { return N; }
-		float3 v0, v1, v2, e1, e2, centroid, N;
-		int objIdx = -1;
-		material* mat;
-	};
-
 	// -----------------------------------------------------------
 	// Mesh Primitive
-	// 
-	// 
+	// Indexed triangle mesh. Positions are welded into a single
+	// shared vertex buffer; the hot intersection data is just the
+	// vertex and face arrays. Normals and the material are only
+	// fetched for the final hit (see FetchHitAttributes).
 	// -----------------------------------------------------------
 	class Mesh {
 	public:
@@ -261,26 +347,16 @@ namespace Tmpl8 {
 		Mesh(int idGroup, const char* path, material* m) : groupIdx(idGroup), mat(m) {
 			FILE* file = fopen(path, "r");
 			float a, c, d, e, f, g, h, i, j;
-			int res = 1;
-			int count = 0;
-			while (res > 0) {
-				
-				res = fscanf(file, "%f %f %f %f %f %f %f %f %f\n",
-					&a, &c, &d, &e, &f, &g, &h, &i, &j);
-				float3 v0 = float3(a, c, d);
-				float3 v1 = float3(e, f, g);
-				float3 v2 = float3(h, i, j);
-				originalVerts.push_back(v0);
-				originalVerts.push_back(v1);
-				originalVerts.push_back(v2);
-				vertices.push_back(v0);
-				vertices.push_back(v1);
-				vertices.push_back(v2);
-				faces.push_back(int3(size(vertices) - 2, size(vertices) - 1, size(vertices)));
-				tri.push_back(Triangle(1000 * idGroup + count, m, v0, v1, v2));
-				count++;
+			while (fscanf(file, "%f %f %f %f %f %f %f %f %f\n",
+				&a, &c, &d, &e, &f, &g, &h, &i, &j) == 9) {
+				uint first = (uint)size(vertices);
+				vertices.push_back(float3(a, c, d));
+				vertices.push_back(float3(e, f, g));
+				vertices.push_back(float3(h, i, j));
+				faces.push_back(int3(first, first + 1, first + 2));
 			}
 			fclose(file);
+			Weld();
 		}
 		Mesh(int idGroup, string path, material* m, float3 pos, float scale) : groupIdx(idGroup), mat(m) {
 			ifstream file(path, ios::in);
@@ -297,44 +373,120 @@ namespace Tmpl8 {
 					istringstream v(line.substr(2));
 					v >> x; v >> y; v >> z;
 					vertices.push_back(float3(x * scale + pos.x, y * scale + pos.y, z * scale + pos.z));
-					originalVerts.push_back(float3(x * scale + pos.x, y * scale + pos.y, z * scale + pos.z));
 				}
 				else if (line.substr(0, 2) == "f ") {
 					int v0, v1, v2;
 					int temp;
 					const char* constL = line.c_str();
 					sscanf(constL, "f %i//%i %i//%i %i//%i", &v0, &temp, &v1, &temp, &v2, &temp);
-					faces.push_back(int3(v0, v1, v2));
+					faces.push_back(int3(v0 - 1, v1 - 1, v2 - 1));
 				}
 			}
-			for (uint i = 0; i < size(faces); i++) {
-				tri.push_back(Triangle(1000 * idGroup + i, m, (faces[i] - 1), vertices));
+			Weld();
+		}
+		// merge bit-identical positions so every vertex is stored once
+		void Weld() {
+			uint rawCount = (uint)size(vertices);
+			vector<uint> order(rawCount), remap(rawCount);
+			for (uint i = 0; i < rawCount; i++) order[i] = i;
+			sort(order.begin(), order.end(), [&](uint a, uint b) {
+				const float3& p = vertices[a], & q = vertices[b];
+				if (p.x != q.x) return p.x < q.x;
+				if (p.y != q.y) return p.y < q.y;
+				return p.z < q.z;
+			});
+			vector<float3> welded;
+			welded.reserve(rawCount);
+			for (uint i = 0; i < rawCount; i++) {
+				const float3& p = vertices[order[i]];
+				if (welded.empty() || p.x != welded.back().x || p.y != welded.back().y || p.z != welded.back().z)
+					welded.push_back(p);
+				remap[order[i]] = (uint)size(welded) - 1;
 			}
-		}
-		uint getSize() {
-			return size(tri);
+			for (uint i = 0; i < size(faces); i++)
+				faces[i] = int3(remap[faces[i].x], remap[faces[i].y], remap[faces[i].z]);
+			vertices.swap(welded);
+			vertices.shrink_to_fit();
+			// previous layout: a 96 byte Triangle per face, the face list and
+			// two copies (current + original) of the unwelded positions
+			size_t legacy = size(faces) * (96 + sizeof(int3)) + 2 * rawCount * sizeof(float3);
+			printf("Mesh %i: %u tris, %u verts (%u before welding), %.1f KB (was %.1f KB, %.1fx less)\n",
+				groupIdx, getSize(), (uint)size(vertices), rawCount, MemoryUsage() / 1024.0f,
+				legacy / 1024.0f, (float)legacy / MemoryUsage());
+		}
+		uint getSize() const {
+			return (uint)size(faces);
+		}
+		size_t MemoryUsage() const {
+			return vertices.capacity() * sizeof(float3) + originalVerts.capacity() * sizeof(float3)
+				+ faces.capacity() * sizeof(int3);
+		}
+		void GetFace(uint f, float3& v0, float3& v1, float3& v2) const {
+			const int3& i = faces[f];
+			v0 = vertices[i.x], v1 = vertices[i.y], v2 = vertices[i.z];
+		}
+		float3 GetCentroid(uint f) const {
+			const int3& i = faces[f];
+			return (vertices[i.x] + vertices[i.y] + vertices[i.z]) * (1.0f / 3);
+		}
+		void IntersectFace(uint f, Ray& ray, float t_min) const {		 //moller-trumbore
+			const int3& i = faces[f];
+			const float3 v0 = vertices[i.x];
+			const float3 e1 = vertices[i.y] - v0, e2 = vertices[i.z] - v0;
+			const float3 h = cross(ray.D, e2);
+			const float a = dot(e1, h);
+			if (fabs(a) < 1e-12f) return;
+			const float inva = 1 / a;
+			const float3 s = ray.O - v0;
+			const float u = inva * dot(s, h);
+			if (u < 0 || u > 1) return;
+			const float3 q = cross(s, e1);
+			const float v = inva * dot(ray.D, q);
+			if (v < 0 || u + v > 1) return;
+			const float t = inva * dot(e2, q);
+			if (t < ray.t && t > t_min)
+				ray.t = t, ray.objIdx = 1000 * groupIdx + f, ray.hitMesh = this, ray.hitFace = f;
+		}
+		bool IsOccludingFace(uint f, const Ray& ray, float t_min) const {
+			const int3& i = faces[f];
+			const float3 v0 = vertices[i.x];
+			const float3 e1 = vertices[i.y] - v0, e2 = vertices[i.z] - v0;
+			const float3 h = cross(ray.D, e2);
+			const float a = dot(e1, h);
+			if (fabs(a) < 1e-12f) return false;
+			const float inva = 1 / a;
+			const float3 s = ray.O - v0;
+			const float u = inva * dot(s, h);
+			if (u < 0 || u > 1) return false;
+			const float3 q = cross(s, e1);
+			const float v = inva * dot(ray.D, q);
+			if (v < 0 || u + v > 1) return false;
+			const float t = inva * dot(e2, q);
+			return t < ray.t && t > t_min;
+		}
+		// cold path: called once per traversal for the closest mesh hit
+		void FetchHitAttributes(Ray& ray) const {
+			float3 v0, v1, v2;
+			GetFace(ray.hitFace, v0, v1, v2);
+			ray.hitNormal = normalize(cross(v1 - v0, v2 - v0));
+			ray.matId = mat->id;
+			ray.hitMesh = 0;
 		}
 		bool IsOccluding(Ray& ray, float t_min) const {
-			for (int i = 0; i < size(faces); i++) {
-				tri[i].IsOccluding(ray, t_min);
+			for (uint i = 0; i < getSize(); i++) {
+				if (IsOccludingFace(i, ray, t_min)) return true;
 			}
-
+			return false;
 		}
 		void Intersect(Ray& ray, float t_min) const {
-			float3 v0, v1, v2;
-			for (int i = 0; i < size(faces); i++) {
-				tri[i].Intersect(ray, t_min);
-			}
-		}
-		void update() {
-			for (int i = 0; i < size(faces); i++) {
-				tri[i].update((faces[i] - 1), vertices);
+			for (uint i = 0; i < getSize(); i++) {
+				IntersectFace(i, ray, t_min);
 			}
+			if (ray.hitMesh == this) FetchHitAttributes(ray);
 		}
 		vector<float3> vertices;
 		vector<int3> faces;
-		vector<Triangle> tri;
-		vector<float3> originalVerts;
+		vector<float3> originalVerts; // rest pose, only captured when animated
 		material* mat;
 		int groupIdx = -1;
 	};
@@ -357,14 +509,14 @@ namespace Tmpl8 {
 			d = sqrtf(d), t = -b - d;
 			if (t < ray.t && t > t_min)
 			{
-				ray.t = t, ray.objIdx = objIdx, ray.m = mat;
+				ray.t = t, ray.objIdx = objIdx, ray.matId = mat->id;
 				ray.SetNormal(GetNormal(ray.IntersectionPoint()));
 				return;
 			}
 			t = d - b;
 			if (t < ray.t && t > t_min)
 			{
-				ray.t = t, ray.objIdx = objIdx, ray.m = mat;
+				ray.t = t, ray.objIdx = objIdx, ray.matId = mat->id;
 				ray.SetNormal(GetNormal(ray.IntersectionPoint()));
 				return;
 			}
@@ -405,7 +557,7 @@ namespace Tmpl8 {
 		void Intersect(Ray& ray, float t_min) const
 		{
 			float t = -(dot(ray.O, this->N) + this->d) / (dot(ray.D, this->N));
-			if (t < ray.t && t > t_min) ray.t = t, ray.objIdx = objIdx, ray.m = mat,
+			if (t < ray.t && t > t_min) ray.t = t, ray.objIdx = objIdx, ray.matId = mat->id,
 				ray.SetNormal(N);
 		}
 		bool IsOccluding(Ray& ray, float t_min) const
@@ -482,12 +634,12 @@ namespace Tmpl8 {
 			tmin = max(tmin, tzmin), tmax = min(tmax, tzmax);
 			if (tmin > t_min)
 			{
-				if (tmin < ray.t) ray.t = tmin, ray.objIdx = objIdx, ray.m = mat,
+				if (tmin < ray.t) ray.t = tmin, ray.objIdx = objIdx, ray.matId = mat->id,
 					ray.SetNormal(GetNormal(ray.IntersectionPoint()));
 			}
 			else if (tmax > t_min)
 			{
-				if (tmax < ray.t) ray.t = tmax, ray.objIdx = objIdx, ray.m = mat,
+				if (tmax < ray.t) ray.t = tmax, ray.objIdx = objIdx, ray.matId = mat->id,
 					ray.SetNormal(GetNormal(ray.IntersectionPoint()));
 			}
 		}
@@ -528,6 +680,14 @@ namespace Tmpl8 {
 			// return normal in world space
 			return TransformVector(N, M);
 		}
+		void Bounds(float3& bmin, float3& bmax) const {
+			// world bounds of the transformed box corners
+			bmin = float3(1e30f), bmax = float3(-1e30f);
+			for (int i = 0; i < 8; i++) {
+				float3 c = TransformPosition(float3(b[i & 1].x, b[(i >> 1) & 1].y, b[i >> 2].z), M);
+				bmin = fminf(bmin, c), bmax = fmaxf(bmax, c);
+			}
+		}
 		float3 GetAlbedo(const float3 I) const
 		{
 			return float3(1, 1, 1);
@@ -560,7 +720,7 @@ namespace Tmpl8 {
 			{
 				float3 I = O + t * D;
 				if (I.x > -size && I.x < size && I.z > -size && I.z < size)
-					ray.t = t, ray.objIdx = objIdx, ray.m = mat,
+					ray.t = t, ray.objIdx = objIdx, ray.matId = mat->id,
 					ray.SetNormal(GetNormal(ray.IntersectionPoint()));
 			}
 		}
@@ -579,102 +739,6 @@ namespace Tmpl8 {
 		material* mat;
 	};
 
-	class material {
-	public:
-		material(float3 c, bool rt) : col(c), raytracer(rt) {}
-
-		void SetColor(float3 c) { col = c; }
-		float3 col, albedo = 0, emission = 0;
-		int type;
-		bool raytracer;
-	};
-
-	
-	class diffuse : public material {
-	public:
-		diffuse(float3 a = 0, float3 c = 0, float ks = 0.2, float kd = 0.8, int n = 2, bool rt = true, float e = 0, float s = 0)
-			: specu(ks), diffu(kd), N(n), material(c, rt) {
-			type = DIFFUSE;
-			albedo = a;
-			emission = e;
-			shinieness = s;
-		}
-		void SetSpecularity(float ks) { specu = ks; }
-		void SetDiffuse(float kd) { diffu = kd; }
-		void SetN(int n) { N = n; }
-		virtual bool scatter(const Ray& ray, float3& att, Ray& scattered,  float3 lightDir, float3 lightIntensity, float3 normal, float3& energy) {
-			float3 reflectionDirection = reflect(-lightDir, normal);
-			float3 specularColor, lightAttenuation;
-			specularColor = powf(fmax(0.0f, -dot(reflectionDirection, ray.D)), N) * lightIntensity;
-			lightAttenuation = lightIntensity;
-			att = albedo * lightAttenuation * diffu + specularColor * specu;
-			float3 dir;
-			if (!raytracer) {
-				dir = RandomInHemisphere(normal);
-			}
-			scattered = Ray(ray.IntersectionPoint(), dir, ray.color);
-			float3 retention = float3(1) - albedo;
-			float3 newEnergy(energy - retention);
-			energy = newEnergy.x > 0 ? newEnergy : 0;
-			return true;
-		}
-
-	public:
-		float specu, diffu, shinieness;
-		int N;
-	};
-
-	class metal : public material {
-	public:
-		metal(float f, float3 c, bool rt) : fuzzy(f < 1 ? f : 1), material(c, rt) { type = METAL; emission = 0; }
-		virtual bool scatter(const Ray& ray, Ray& reflected, float3 normal, float3& energy) {
-			float3 dir = reflect(ray.D, normal);
-			reflected = Ray(ray.IntersectionPoint() + normal * 0.001f, dir, ray.color * col);
-			energy = energy;
-			return dot(reflected.D, normal) > 0;
-		}
-
-	public:
-		float fuzzy;
-	};
-
-	class glass : public material{
-	public: 
-		glass(float refIndex, float3 c, float3 a, float r, float n, bool rt)
-			: ir(refIndex), absorption(a), specu(r), N(n), material(c, rt) {
-			type = GLASS; invIr = 1 / ir;
-		}
-		void fresnel(const float3& I, const float3& N, const float& ior, float& kr)
-		{
-			float cosi = clamp(dot(I, N) ,-1.0f, 1.0f);
-			float etai = 1, etat = ior;				 
-			if (cosi > 0) { std::swap(etai, etat); }
-			float sint = etai / etat * sqrtf(fmaxf(0.f, 1 - cosi * cosi));
-			// Total internal reflection
-			if (sint >= 1) {
-				kr = 1;
-			}
-			else {
-				float cost = sqrtf(fmaxf(0.f, 1 - sint * sint));
-				cosi = fabsf(cosi);
-				float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-				float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-				kr = (Rs * Rs + Rp * Rp) / 2;
-			}
-			// As a consequence of the conservation of energy, transmittance is given by:
-			// kt = 1 - kr;
-		}
-		float3 RefractRay(const float3& oRayDir, const float3& normal, const float& refRatio) {
-			float theta = fmin(dot(-oRayDir, normal), 1.0);	  
-			float3 perpendicular = refRatio * (oRayDir + theta * normal);
-			float3	parallel = -sqrt(fabs(1.0 - pow(length(perpendicular), 2))) * normal;
-			return perpendicular + parallel;									  
-		}
-
-		float ir, fresnelVal, specu, N, invIr;
-		float3 absorption;
-	};
-
 	// -----------------------------------------------------------
 	// Scene class
 	// We intersect this. The query is internally forwarded to the
@@ -692,9 +756,14 @@ namespace Tmpl8 {
 			
 			
 			if (useTLAS) {
-				TLASSceneTest();
+				if (nestedTLAS) NestedTLASScene();
+				else if (animTLAS) TLASAnimScene();
+				else TLASSceneTest();
+				AddTopLevelPrimitives();
 				tl = new tlas(bvhList, bvhCount);
+				tl->planes.Set(planes);
 				tl->build();
+				printf("TLAS Build time : %5.2f ms (%u instances)\n", tl->buildTime, tl->blasCount);
 			}
 			else {
 				instantiateBackgroundScene();
@@ -707,7 +776,20 @@ namespace Tmpl8 {
 				//b->Build(true);  // to use	QBVH, put true;
 			}
 
-			
+			lightTree.Build(lights);
+			// the guide's grid and the cache's cells follow the scene as built
+			if (useTLAS) boundsMin = tl->tlasNode[0].aabbMin, boundsMax = tl->tlasNode[0].aabbMax;
+			else boundsMin = b->bvhNode[0].aabbMin, boundsMax = b->bvhNode[0].aabbMax;
+			if (!(boundsMin.x <= boundsMax.x)) {
+				// empty tree: the root box is inverted. Cover the lights and
+				// the origin instead, so the grids still get a finite extent
+				aabb box;
+				box.grow(float3(-1)), box.grow(float3(1));
+				for (AreaLight* light : lights) box.grow(light->pos);
+				boundsMin = box.bmin, boundsMax = box.bmax;
+			}
+			guide.Init(boundsMin, boundsMax);
+			cache.Init(boundsMin, boundsMax);
 			
 			SetTime(0);
 
@@ -722,7 +804,10 @@ namespace Tmpl8 {
 				myFile << names[i] << ",";
 				if(useTLAS){
 					for (int bi = 0; bi < bvhCount; bi++) {
-						switch (i) {
+						// nested TLAS instances have no stats of their own: -1
+						// keeps the columns aligned with bvhList
+						if (!bvhList[bi].bvh && i != 5) myFile << -1;
+						else switch (i) {
 						case 0: 
 							myFile << bvhList[bi].bvh->dataCollector->GetNodeCount();
 							break;
@@ -776,6 +861,28 @@ namespace Tmpl8 {
 				}
 				myFile << "\n";
 			}
+			// batched traversal against the per-ray kernel, at this mesh size
+			if (!useTLAS) myFile << "Primitive Count," << b->N << "\n";
+			else myFile << "TLAS Build time," << tl->buildTime << "\n";
+			myFile << "Batched Traversal Speedup," << batchSpeedup << "\n";
+			// shadow rays are any-hit queries: reported apart from closest hits
+			myFile << "Closest-Hit MRays/s," << closestHitRate << "\n";
+			myFile << "Shadow MRays/s," << shadowRate << "\n";
+			myFile << "Shadow MRays/s (occluder cache)," << shadowCachedRate << "\n";
+			// first-bounce rays in pixel order and sorted by origin and direction
+			myFile << "Secondary MRays/s (unsorted)," << secondaryRate[0] << "\n";
+			myFile << "Secondary MRays/s (sorted)," << secondaryRate[1] << "\n";
+			myFile << "Secondary L1 Hit Rate (unsorted)," << secondaryHitRate[0] << "\n";
+			myFile << "Secondary L1 Hit Rate (sorted)," << secondaryHitRate[1] << "\n";
+			myFile << "TLAS Build ms (1M instances)," << tlasBuildTime1M << "\n";
+			// seconds to the target RMSE; -1 when not reached in time, 0 when not measured
+			myFile << "Time to RMSE (BSDF only)," << timeToRMSE[0] << "\n";
+			myFile << "Time to RMSE (NEE+MIS)," << timeToRMSE[1] << "\n";
+			myFile << "Time to RMSE (ReSTIR)," << timeToRMSE[2] << "\n";
+			// RMSE after equal render time; -1 when not measured
+			myFile << "Equal-time RMSE (BSDF only)," << rmseEqualTime[0] << "\n";
+			myFile << "Equal-time RMSE (NEE+MIS)," << rmseEqualTime[1] << "\n";
+			myFile << "Equal-time RMSE (ReSTIR)," << rmseEqualTime[2] << "\n";
 
 
 			//cout << b->dataCollector->GetTreeDepth() << endl;
@@ -789,7 +896,7 @@ namespace Tmpl8 {
 		}
 
 		void instantiateBackgroundScene() {
-			skydome = stbi_load("Resources/hdr.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/hdr.hdr");
 			lights.push_back(new AreaLight(11, float3(4.5f, 5.0f,7.0f), 19.0f, white, 2.0f, float3(0, -1, 0), 4, raytracer));
 			glass* orange = new glass(1.5f, float3(212, 34, 93) /255, float3(0.0f), 0.0f, 0, raytracer);
 			glass* redGlass = new glass(1.5f, red, float3(0.0f), 0.0f, 0, raytracer);
@@ -812,7 +919,7 @@ namespace Tmpl8 {
 
 		}
 		void instantiatePrettyScene1() {
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			lights.push_back(new AreaLight(11, float3(0.1f, 4.0f, 5.0f), 8.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
 			lights.push_back(new AreaLight(12, float3(0.1f, 4.0f, 3.0f), 10.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
 			diffuse* lightDiff = new diffuse(float3(0.8f), white, 0.6f, 0.4f, 1200, raytracer, 1.2f);
@@ -841,7 +948,7 @@ namespace Tmpl8 {
 
 		void instantiatePrettyAnimationScene() {
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* blueDiff = new diffuse(float3(0.8f), blue, 0.2f, 0.8f, 1, raytracer);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.2f, 0.8f, 1, raytracer);
 			diffuse* whiteDiff = new diffuse(0.8f, white, 0.0f, 1.0f, 4, raytracer);
@@ -868,7 +975,7 @@ namespace Tmpl8 {
 			meshes.push_back(Mesh(2, "Resources/BigB.obj", redDiff, float3(-2, 1.0f, 0), 4.0f));
 		}
 		void instantiateEifelScene() {
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* lightDiff = new diffuse(float3(0.8f), white, 0.6f, 0.4f, 1200, raytracer, 1.2f);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.6f, 0.4f, 2, raytracer);
 			planes.push_back(Plane(2, lightDiff, float3(0, 1, 0), 1));			// 2: floor
@@ -878,7 +985,7 @@ namespace Tmpl8 {
 		}
 
 		void instantiateBigBScene() {
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* lightDiff = new diffuse(float3(0.8f), white, 0.6f, 0.4f, 1200, raytracer, 1.2f);
 			planes.push_back(Plane(2, lightDiff, float3(0, 1, 0), 1));			// 2: floor
 			lights.push_back(new AreaLight(11, float3(0.1f, 7.0f, 3.0f), 8.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
@@ -889,7 +996,7 @@ namespace Tmpl8 {
 		}
 
 		void instantiateChristScene() {
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* lightDiff = new diffuse(float3(0.8f), white, 0.6f, 0.4f, 1200, raytracer, 1.2f);
 			planes.push_back(Plane(2, lightDiff, float3(0, 1, 0), 1));			// 2: floor
 			lights.push_back(new AreaLight(11, float3(0.1f, 7.0f, 5.0f), 8.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
@@ -898,6 +1005,104 @@ namespace Tmpl8 {
 			meshes.push_back(Mesh(2, "Resources/christ.obj", yellowMetal, float3(0, -0.5f, 6.2f), 0.3f));
 		}
 
+		// spheres, cubes and area lights outside the instanced meshes go in one
+		// more BLAS, so that every ray does a single traversal of the TLAS;
+		// the planes are unbounded and tested by the TLAS itself
+		void AddTopLevelPrimitives() {
+			bvh* top = new bvh(this);
+			top->topLevel = true;
+			top->Build(false);
+			if (top->N == 0) { delete top; return; }
+			bvhInstance* list = new bvhInstance[bvhCount + 1];
+			for (uint i = 0; i < bvhCount; i++) list[i] = bvhList[i];
+			list[bvhCount++] = bvhInstance(top);
+			delete[] bvhList;
+			bvhList = list;
+		}
+		void NestedTLASScene() {
+			// props -> room -> building -> street: every level is one TLAS
+			// instanced by the level above, so memory follows the unique parts
+			metal* goldMetal = new metal(0.7f, gold, raytracer);
+			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.0f, 1, 1, raytracer);
+			diffuse* specReflDiff = new diffuse(float3(0.7f), white, 0.6f, 0.4f, 50, raytracer, 0.0f);
+			LoadSky("Resources/sky.hdr");
+			lights.push_back(new AreaLight(11, float3(0, 8.0f, 0), 10.0f, white, 1.0f, float3(0, -1, 0), 2, raytracer));
+
+			meshes.push_back(Mesh(1, "Resources/stellatedDode.obj", goldMetal, float3(0), 1));
+			meshes.push_back(Mesh(2, "Resources/ico.obj", redDiff, float3(0), 1));
+			bvh* props[2];
+			for (int i = 0; i < 2; i++) {
+				props[i] = new bvh(&meshes[i]);
+				props[i]->Build();
+			}
+
+			// room: 2x4 props
+			bvhInstance* room = new bvhInstance[8];
+			for (int i = 0; i < 8; i++) {
+				room[i] = bvhInstance(props[i & 1]);
+				room[i].SetTransform(mat4::Translate(float3((i & 1) * 0.6f - 0.3f, 0, (i >> 1) * 0.6f - 0.9f)) * mat4::Scale(0.12f));
+			}
+			tlas* roomTLAS = new tlas(room, 8);
+			roomTLAS->build();
+
+			// building: 4x4 rooms, each turned by a quarter
+			bvhInstance* building = new bvhInstance[16];
+			for (int i = 0; i < 16; i++) {
+				building[i] = bvhInstance(roomTLAS);
+				building[i].SetTransform(mat4::Translate(float3((i & 3) * 2.5f - 3.75f, 0, (i >> 2) * 2.5f - 3.75f)) * mat4::RotateY(i * PI * 0.5f));
+			}
+			tlas* buildingTLAS = new tlas(building, 16);
+			buildingTLAS->build();
+
+			// street: three buildings
+			bvhCount = 3;
+			bvhList = new bvhInstance[bvhCount];
+			Transforms = new mat4[bvhCount];
+			for (uint i = 0; i < bvhCount; i++) {
+				Transforms[i] = mat4::Translate(float3(i * 11.0f - 11.0f, 0, 12)) * mat4::RotateY(i * 0.3f);
+				bvhList[i] = bvhInstance(buildingTLAS);
+				bvhList[i].SetTransform(Transforms[i]);
+			}
+
+			planes.push_back(Plane(0, specReflDiff, float3(0, 1, 0), 0));			// 2: floor
+		}
+		void TLASAnimScene() {
+			// a few hundred moving instances of three meshes, for the dynamic TLAS
+			metal* goldMetal = new metal(0.7f, gold, raytracer);
+			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.0f, 1, 1, raytracer);
+			diffuse* blueDiff = new diffuse(float3(0.8f), blue, 0.0f, 1, 1, raytracer);
+			diffuse* specReflDiff = new diffuse(float3(0.7f), white, 0.6f, 0.4f, 50, raytracer, 0.0f);
+			LoadSky("Resources/sky.hdr");
+			lights.push_back(new AreaLight(11, float3(0, 8.0f, 0), 10.0f, white, 1.0f, float3(0, -1, 0), 2, raytracer));
+
+			meshes.push_back(Mesh(1, "Resources/stellatedDode.obj", goldMetal, float3(0), 1));
+			meshes.push_back(Mesh(2, "Resources/ico.obj", redDiff, float3(0), 1));
+			meshes.push_back(Mesh(3, "Resources/BigB.obj", blueDiff, float3(0), 1));
+			bvh* blas[3];
+			for (int i = 0; i < 3; i++) {
+				blas[i] = new bvh(&meshes[i]);
+				blas[i]->Build();
+			}
+
+			bvhCount = 400;
+			bvhList = new bvhInstance[bvhCount];
+			Transforms = new mat4[bvhCount];
+			instancePos.resize(bvhCount);
+			instanceIdx.resize(bvhCount);
+			instanceTransforms.resize(bvhCount);
+			const float scale[3] = { 0.15f, 0.2f, 0.25f };
+			for (uint i = 0; i < bvhCount; i++) {
+				int type = i % 3;
+				// 20x20 grid, jittered, lifted off the floor
+				instancePos[i] = float3((i % 20) - 9.5f + RandomFloat() * 0.5f, 0.5f + RandomFloat() * 2, (i / 20) - 9.5f + RandomFloat() * 0.5f);
+				Transforms[i] = mat4::Scale(scale[type]) * mat4::RotateX(RandomFloat() * TWOPI);
+				instanceIdx[i] = i;
+				bvhList[i] = bvhInstance(blas[type]);
+				bvhList[i].SetTransform(mat4::Translate(instancePos[i]) * Transforms[i]);
+			}
+
+			planes.push_back(Plane(0, specReflDiff, float3(0, 1, 0), 0));			// 2: floor
+		}
 		void TLASSceneTest() {
 			metal* standardMetal = new metal(0.7f, white, raytracer);
 			metal* goldMetal = new metal(0.7f, gold, raytracer);
@@ -906,7 +1111,7 @@ namespace Tmpl8 {
 			diffuse* goldDiff = new diffuse(float3(0.8f), gold, 0.8f, 0.2f, 1, raytracer);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.0f, 1, 1, raytracer);
 			diffuse* specReflDiff = new diffuse(float3(0.7f), white, 0.6f, 0.4f, 50, raytracer, 0.0f);
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			//lights.push_back(new Light(11, float3(0, 6.0f, 0), 4, white, float3(0, -1, 0), raytracer));
 			lights.push_back(new AreaLight(11, float3(0, 8.0f, 0), 10.0f, white, 1.0f, float3(0, -1, 0), 2, raytracer));
 
@@ -945,7 +1150,7 @@ namespace Tmpl8 {
 
 			diffuse* goldDiff = new diffuse(float3(0.8f), gold, 0.8f, 0.2f, 1, raytracer);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.0f, 1, 1, raytracer);
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			//lights.push_back(new Light(11, float3(0, 6.0f, 0), 4, white, float3(0, -1, 0), raytracer));
 			lights.push_back(new AreaLight(11, float3(0, 6.0f, 0), 16.0f, white, 2.0f, float3(0, -1, 0), 2, raytracer));
 
@@ -975,7 +1180,7 @@ namespace Tmpl8 {
 			defaultAnim = false;
 			animOn = raytracer && defaultAnim;
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			
 			glass* standardGlass = new glass(1.5f, white, float3(0.00f), 0.0f, 0, raytracer);
 			diffuse* specularDiff = new diffuse(float3(0.8f), white, 0.6f, 0.4f, 2, raytracer, 0);
@@ -1006,7 +1211,7 @@ namespace Tmpl8 {
 		void instantiateScene2() {
 
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* blueDiff = new diffuse(float3(0.8f), blue, 0.2f, 0.8f,  1, raytracer);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.2f, 0.8f, 1, raytracer);
 			diffuse* whiteDiff = new diffuse(0.8f, white, 0.0f, 1.0f, 4, raytracer);
@@ -1045,7 +1250,7 @@ namespace Tmpl8 {
 		void instantiateScene3() {
 
 			//Loading sky texture
-			skydome = stbi_load("Resources/night.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/night.hdr");
 
 			glass* standardGlass = new glass(1.5f, white, float3(0.00f), 0.0f, 0, raytracer);
 			glass* greenGlass = new glass(1.5f, green, float3(0.00f), 0.0f, 0, raytracer);
@@ -1094,7 +1299,7 @@ namespace Tmpl8 {
 		void instantiateScene4() {
 
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 
 			glass* standardGlass = new glass(1.5f, white, float3(0.00f), 0.0f, 0, raytracer);
 			glass* blueGlass = new glass(1.5f, babyblue, float3(0.0f), 0.0f, 0, raytracer);
@@ -1117,7 +1322,7 @@ namespace Tmpl8 {
 		void instantiateScene5() {
 
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* goldDiff = new diffuse(float3(0.8f), gold, 0.6f, 0.4f, 30, raytracer);
 
 			lights.push_back(new AreaLight(11, float3(1, 2.0f, 1), 10.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
@@ -1136,7 +1341,7 @@ namespace Tmpl8 {
 
 			diffuse* goldDiff = new diffuse(float3(0.8f), gold, 0.8f, 0.2f, 1, raytracer);
 			diffuse* redDiff = new diffuse(float3(0.8f), red, 0.0f, 1, 1, raytracer);
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			//lights.push_back(new Light(11, float3(0, 6.0f, 0), 4, white, float3(0, -1, 0), raytracer));
 			lights.push_back(new AreaLight(11, float3(0, 6.0f, 0), 16.0f, white, 2.0f, float3(0, -1, 0), 2, raytracer));
 
@@ -1170,36 +1375,35 @@ namespace Tmpl8 {
 		}
 
 		void instantiateScene7() {
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			diffuse* whiteDiff = new diffuse(0.8f, white, 0.0f, 1.0f, 4, raytracer);
 			planes.push_back(Plane(0, whiteDiff, float3(0, 1, 0), 1));			// 0: floor
 			lights.push_back(new AreaLight(11, float3(-1, 8.0f, -1), 25.0f, white, 3.0f, float3(0, -1, 0), 4, raytracer));
 
+			// random colours from a palette per material type: a material per
+			// sphere would use up the 16-bit material ids
+			const int paletteSize = 64;
+			vector<material*> palette[3];
+			for (int i = 0; i < paletteSize; i++) {
+				palette[0].push_back(new metal(0.7f, float3(RandomFloat(), RandomFloat(), RandomFloat()), raytracer));
+				palette[1].push_back(new glass(1.5f, float3(RandomFloat(), RandomFloat(), RandomFloat()), float3(0.00f), 0.0f, 0, raytracer));
+				palette[2].push_back(new diffuse(float3(0.8f), float3(RandomFloat(), RandomFloat(), RandomFloat()), 0.2f, 0.8f, 2, raytracer));
+			}
 			int amountSpheresX = 255;
 			int amountSpheresY = 255;
 			for (int x = 0; x < amountSpheresX; x++) {
 				for (int y = 0; y < amountSpheresY; y++) {
 					float die = RandomFloat();
-					if(die < 0.33){
-						metal* met = new metal(0.7f, float3(RandomFloat(), RandomFloat(), RandomFloat()), raytracer);
-						spheres.push_back(Sphere(13 + x + y, met, float3(x, -0.5f, y), 0.5f));
-					}
-					else if (die < 0.66)
-					{
-						glass* g = new glass(1.5f, float3(RandomFloat(), RandomFloat(), RandomFloat()), float3(0.00f), 0.0f, 0, raytracer);
-						spheres.push_back(Sphere(13 + x + y, g, float3(x, -0.5f, y), 0.5f));
-					}
-					else {
-						diffuse* diff = new diffuse(float3(0.8f), float3(RandomFloat(), RandomFloat(), RandomFloat()), 0.2f, 0.8f, 2, raytracer);
-						spheres.push_back(Sphere(13 + x + y, diff, float3(x, -0.5f, y), 0.5f));
-					}
+					int type = die < 0.33f ? 0 : die < 0.66f ? 1 : 2;
+					material* m = palette[type][min(paletteSize - 1, (int)(RandomFloat() * paletteSize))];
+					spheres.push_back(Sphere(13 + x + y, m, float3(x, -0.5f, y), 0.5f));
 				}
 			}
 		}
 
 		void instantiateScene8() {
 			//Loading sky texture
-			skydome = stbi_load("Resources/sky.hdr", &skydomeX, &skydomeY, &skydomeN, 3);
+			LoadSky("Resources/sky.hdr");
 			metal* redMetal = new metal(0.7f, red, raytracer);
 			metal* yellowMetal = new metal(0.7f, gold, raytracer);
 			lights.push_back(new AreaLight(11, float3(0, 8.0f, 0), 10.0f, white, 1.0f, float3(0, -1, 0), 4, raytracer));
@@ -1228,21 +1432,51 @@ namespace Tmpl8 {
 			if (animOn) {
 				float r = fmodf(t, 2 * PI);
 				float a = sinf(r) * 0.5f;
+				// track which primitives actually moved so the refit can skip
+				// untouched subtrees; triangles come first in the bvh index space
+				dirtyPrims.assign(max(b->N, getTriangleNb()), 0);
+				uint triOffset = 0;
 				for (int i = 0; i < size(meshes); i++)
 				{
-					for (int j = 0; j < size(meshes[i].vertices); j++)
+					Mesh& mesh = meshes[i];
+					if (mesh.originalVerts.empty()) mesh.originalVerts = mesh.vertices;
+					movedVerts.assign(size(mesh.vertices), 0);
+#pragma omp parallel for schedule(static)
+					for (int j = 0; j < size(mesh.vertices); j++)
 					{
-						float3 o = meshes[i].originalVerts[j];
+						float3 o = mesh.originalVerts[j];
 						float s = a * o.y * 0.2f;
 						float x = o.x * cosf(s) - o.y * sinf(s);
 						float y = o.x * sinf(s) + o.y * cosf(s);
-						meshes[i].vertices[j] = float3(x, y, o.z);
+						float3& v = mesh.vertices[j];
+						if (v.x == x && v.y == y && v.z == o.z) continue;
+						v = float3(x, y, o.z);
+						movedVerts[j] = 1;
+					}
+					for (uint f = 0; f < mesh.getSize(); f++) {
+						const int3& v = mesh.faces[f];
+						dirtyPrims[triOffset + f] = movedVerts[v.x] | movedVerts[v.y] | movedVerts[v.z];
 					}
-					meshes[i].update();
+					triOffset += mesh.getSize();
 				}
 			}
-			if (animOn) b->Refit();
-			//if (animOn) tl->Build();
+			if (animOn) b->Update(dirtyPrims.data());
+			if (useTLAS && animTLAS && !nestedTLAS) {
+				// every instance orbits the origin and spins around its own axis;
+				// the TLAS decides whether a refit is enough or a rebuild pays off
+				// the moving instances come first, see AddTopLevelPrimitives
+#pragma omp parallel for schedule(static)
+				for (int i = 0; i < (int)instancePos.size(); i++)
+				{
+					float phase = i * 0.618034f * TWOPI;
+					float3 p = instancePos[i];
+					float orbit = animTime * (0.2f + 0.3f * fmodf(phase, 1.0f));
+					float3 o = float3(p.x * cosf(orbit) - p.z * sinf(orbit), p.y + 0.3f * sinf(animTime * 2 + phase), p.x * sinf(orbit) + p.z * cosf(orbit));
+					instanceTransforms[i] = mat4::Translate(o) * mat4::RotateY(animTime + phase) * Transforms[i];
+				}
+				tl->SetTransforms(instanceIdx.data(), instanceTransforms.data(), (uint)instanceIdx.size());
+				tl->Update();
+			}
 		}
 
 		void FindNearest(Ray& ray, float t_min) const
@@ -1254,39 +1488,48 @@ namespace Tmpl8 {
 			for (int i = 0; i < size(cubes); ++i) cubes[i].Intersect(ray, t_min);
 			for (int i = 0; i < size(meshes); ++i) meshes[i].Intersect(ray, t_min);*/
 
-			for (int i = 0; i < size(lights); ++i) lights[i]->Intersect(ray, t_min);
-
-			if (useTLAS) {
-				for (int i = 0; i < size(spheres); ++i) spheres[i].Intersect(ray, t_min);
-				for (int i = 0; i < size(planes); ++i) planes[i].Intersect(ray, t_min);
-				tl->Intersect(ray);
-			}
-			else {
-				b->Intersect(ray);
-			}
+			// one traversal: every primitive lives in the acceleration structure
+			if (useTLAS) tl->Intersect(ray, traversal);
+			else b->Intersect(ray, traversal);
 		}
 
-		bool IsOccluded(Ray& ray, float t_min) const
+		// FindNearest for a batch of independent rays; without a TLAS the
+		// rays interleave their traversal, see bvh::IntersectBatch
+		void FindNearestBatch(Ray* rays, uint count) const
 		{
-			// - we potentially search beyond rayLength
-			float rayLength = ray.t;
-			for (int i = 0; i < size(planes); ++i)
-				if(planes[i].IsOccluding(ray, t_min)) return true;
-			for (int i = 0; i < size(spheres); ++i) 
-				if (spheres[i].IsOccluding(ray, t_min)) return true;
-			for (int i = 0; i < size(cubes); ++i)
-				if (cubes[i].IsOccluding(ray, t_min)) return true;
-			for (int i = 0; i < size(meshes); ++i)
-				if (meshes[i].IsOccluding(ray, t_min)) return true;
+			for (uint i = 0; i < count; i++) rays[i].objIdx = -1;
+			if (!useTLAS) b->IntersectBatch(rays, count);
+			else for (uint i = 0; i < count; i++) FindNearest(rays[i], 1e-6f);
+		}
 
-			return false;
+		// shadow ray towards light lightIdx: each thread remembers the leaf
+		// that last blocked a ray to each light and tests it before traversal
+		bool IsOccludedFromLight(Ray& ray, uint lightIdx) const
+		{
+			if (useTLAS) return tl->IsOccluded(ray, traversal);
+			static thread_local vector<uint> lastOccluder;
+			if (lastOccluder.size() < lights.size()) lastOccluder.resize(lights.size(), 0);
+			return b->IsOccludedCached(ray, lastOccluder[lightIdx], traversal);
+		}
 
+		// shadow rays from one shading point, e.g. samples on an area light;
+		// traced four at a time as packets, see bvh::IsOccludedPacket
+		void IsOccludedPacket(Ray* rays, int count, bool* occluded) const
+		{
+			if (useTLAS) {
+				for (int i = 0; i < count; i++) occluded[i] = tl->IsOccluded(rays[i], traversal);
+				return;
+			}
+			for (int i = 0; i < count; i += 4) {
+				int mask = b->IsOccludedPacket(rays + i, min(4, count - i));
+				for (int k = 0; k < 4 && i + k < count; k++) occluded[i + k] = (mask >> k) & 1;
+			}
 		}
 
 		bool IsOccluded(Ray& ray) const
 		{
-			if (useTLAS) return tl->IsOccluded(ray);
-			else return b->IsOccluded(ray);
+			if (useTLAS) return tl->IsOccluded(ray, traversal);
+			else return b->IsOccluded(ray, traversal);
 			return false;
 		}
 
@@ -1309,23 +1552,84 @@ namespace Tmpl8 {
 			return objIdx == 3 ? 1.0f : 0.0f;
 		}
 
+		// the sky is stored as float RGB in an equal-area mapping: x follows
+		// the angle around the y axis and y the height, so every texel covers
+		// the same solid angle 4 PI / (skydomeX * skydomeY)
+		void LoadSky(const char* file)
+		{
+			skydome = stbi_loadf(file, &skydomeX, &skydomeY, &skydomeN, 3);
+			BuildSkyAlias();
+		}
+
+		// alias table over the texels by luminance: SampleSky picks a texel
+		// in O(1), with probability skyPmf
+		void BuildSkyAlias()
+		{
+			const uint n = skydome ? skydomeX * skydomeY : 0;
+			skyPmf.resize(n), skyProb.resize(n), skyAlias.resize(n);
+			double total = 0;
+			for (uint i = 0; i < n; i++)
+			{
+				const float* c = skydome + i * 3;
+				total += skyPmf[i] = max(0.0f, 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]);
+			}
+			vector<uint> small, large;
+			for (uint i = 0; i < n; i++)
+			{
+				skyPmf[i] = total > 0 ? (float)(skyPmf[i] / total) : 1.0f / n;
+				skyProb[i] = skyPmf[i] * n, skyAlias[i] = i;
+				(skyProb[i] < 1 ? small : large).push_back(i);
+			}
+			// each small texel is topped up to 1 by a large one
+			while (!small.empty() && !large.empty())
+			{
+				uint s = small.back(), l = large.back();
+				small.pop_back();
+				skyAlias[s] = l;
+				skyProb[l] -= 1 - skyProb[s];
+				if (skyProb[l] < 1) large.pop_back(), small.push_back(l);
+			}
+			// what is left over is 1 up to rounding
+			for (uint i : small) skyProb[i] = 1;
+			for (uint i : large) skyProb[i] = 1;
+		}
+
+		// texel of a unit direction: no acos or normalisation, and indices
+		// clamped to the last texel
+		int SkyTexel(const float3& D) const
+		{
+			int x = (int)((atan2f(D.x, D.z) + PI) * INV2PI * skydomeX);
+			int y = (int)((1 - D.y) * 0.5f * skydomeY);
+			x = clamp(x, 0, skydomeX - 1), y = clamp(y, 0, skydomeY - 1);
+			return x + y * skydomeX;
+		}
+
+		// without a loaded sky (skydome null, skyPmf empty) the sky is black
+		// and is never sampled: SampleSky returns a pdf of 0
 		float3 GetSkyColor(Ray &r) const
-		{	
-			float3 horizontalProj = float3(r.D.x, 0, r.D.z);
-			float cHeight = dot(r.D, float3(0, -1, 0));
-			float cOrient = dot(float3(0, 0, 1), normalize(horizontalProj));
-			float sOrient = dot(float3(1, 0, 0), normalize(horizontalProj));
-			sOrient = sOrient > 0 ? 1 : -1;
-			int y = ((cHeight + 1) / 2) * (skydomeY-1);
-			int x = (((sOrient * acos(cOrient))+PI)/ TWOPI )* (skydomeX-1);
-			if (x >= skydomeX) x  = skydomeX ;
-			if (y >= skydomeY) y  = skydomeY ;
-			if (y < 0) y  = 0 ;
-			if (x < 0) x=0 ;
-			uint8_t* pixelOffset = skydome + (x + skydomeX * y) * skydomeN;
-			return float3(uint3(pixelOffset[0], pixelOffset[1], pixelOffset[2]))/255;
+		{
+			if (!skydome) return float3(0);
+			const float* c = skydome + SkyTexel(r.D) * 3;
+			return float3(c[0], c[1], c[2]);
 		}
 
+		// direction towards the sky and its solid-angle density, for light
+		// sampling; texels by luminance, uniform within the texel
+		float3 SampleSky(float& pdf) const
+		{
+			const uint n = (uint)skyPmf.size();
+			if (n == 0) { pdf = 0; return float3(0, 1, 0); }
+			uint i = min(n - 1, (uint)(RandomFloat() * n));
+			if (RandomFloat() >= skyProb[i]) i = skyAlias[i];
+			float u = ((i % skydomeX) + RandomFloat()) / skydomeX;
+			float v = ((i / skydomeX) + RandomFloat()) / skydomeY;
+			float y = 1 - 2 * v, r = sqrtf(max(0.0f, 1 - y * y)), phi = u * TWOPI - PI;
+			float3 D(r * sinf(phi), y, r * cosf(phi));
+			pdf = SkyPdf(D);
+			return D;
+		}
+		float SkyPdf(const float3& D) const { return skyPmf.empty() ? 0 : skyPmf[SkyTexel(D)] * skyPmf.size() * 0.25f * INVPI; }
+
 		uint getTriangleNb() {
 			uint acc = 0;
 			for (int i = 0; i < size(meshes); i++) {
@@ -1334,15 +1638,6 @@ namespace Tmpl8 {
 			return acc;
 		}
 
-		Triangle getTriangle(uint idx) {
-			int i = 0;
-			while (idx >= meshes[i].getSize() && i < getTriangleNb()) {
-				idx -= meshes[i].getSize();
-				i++;
-			}
-			return meshes[i].tri[idx];
-		}
-
 		void SetIterationNumber(int i) { iterationNumber = i; }
 
 		int GetIterationNumber() { return iterationNumber; }
@@ -1365,17 +1660,42 @@ namespace Tmpl8 {
 			, "Average Primitive Intersections per screen", "Average Traversal Steps per screen",
 			"Max Tree Depth", "Average FPS", "BVH Build time"};
 
-		unsigned char* skydome;
+		float* skydome;
+		vector<float> skyPmf, skyProb; // per texel: probability, alias table threshold
+		vector<uint> skyAlias;
 		float runTime = 0;
+		float batchSpeedup = 0; // see Renderer::BenchmarkBatchTraversal
+		float closestHitRate = 0, shadowRate = 0, shadowCachedRate = 0; // see Renderer::BenchmarkShadowRays
+		float secondaryRate[2] = {}, secondaryHitRate[2] = {}; // unsorted, sorted; see Renderer::BenchmarkSecondaryRays
+		float tlasBuildTime1M = 0; // ms, see Renderer::BenchmarkTLASBuild
+		// SampleNEE without and with light samples, ReSTIR; see Renderer::MeasureConvergence
+		float timeToRMSE[3] = {}, rmseEqualTime[3] = {};
+		bool useNEE = true; // path tracer: next-event estimation with MIS, see Renderer::SampleNEE
+		lightBVH lightTree; // picks lights for SampleNEE, built once the scene's lights are in
+		int lightPicks = 1; // lights sampled per diffuse vertex
+		bool useReSTIR = false; // path tracer: direct light at primary hits by Renderer::RenderReSTIR
+		bool useGuiding = false; // SampleNEE: diffuse bounces follow the learned guide
+		bool guideDebug = false; // overlay the guide's bins at the cell under the mouse
+		pathGuide guide;
+		bool useCache = false; // path tracers: end diffuse paths in the radiance cache
+		int cacheDepth = 3; // Sample: depth from which hits use the cache (primary hits have 4)
+		radianceCache cache;
+		bool batchShading = false; // path tracer: lines traced as batches sorted by material, see Renderer::SampleBatch
+		bool sortRays = false; // SampleBatch: secondary rays sorted by origin and direction before traversal
+		float3 boundsMin, boundsMax; // of the scene as built
 		bool exported = false;
-		bvh* b; tlas* tl; bvhInstance* bvhList; 
+		bvh* b = nullptr; tlas* tl = nullptr; bvhInstance* bvhList = nullptr;
 		uint bvhCount = 3;
 		mat4* Transforms;
+		vector<float3> instancePos; // animated TLAS scene only
+		vector<uint> instanceIdx;
+		vector<mat4> instanceTransforms;
 		vector<Light*> lights;
 		vector<Cube> cubes;
 		vector<Sphere> spheres;
 		vector<Mesh> meshes;
 		vector<Plane> planes;
+		vector<uchar> dirtyPrims, movedVerts; // per-frame refit masks
 		int aaSamples = 1;
 		int invAaSamples = 1 / aaSamples;
 		int iterationNumber = 1;
@@ -1386,6 +1706,9 @@ namespace Tmpl8 {
 		bool defaultAnim = false;
 		//bool animOn = raytracer && defaultAnim; // set to false while debugging to prevent some cast error from primitive object type
 		bool useTLAS = false;
+		bool animTLAS = false; // with useTLAS: hundreds of moving instances, see TLASAnimScene
+		bool nestedTLAS = false; // with useTLAS: instanced TLASes, see NestedTLASScene
+		TraversalMode traversal = TRAVERSE_STACK; // TRAVERSE_STACKLESS: parent links, no per-ray stack
 		bool animOn = raytracer && defaultAnim && !useTLAS; // set to false while debugging to prevent some cast error from primitive object type
 		const float3 white = float3(1.0, 1.0, 1.0);
 		const float3 red = float3(255, 0, 0) / 255;
@@ -5,48 +5,322 @@ tlas::tlas(bvhInstance* bvhList, int N)
     // copy a pointer to the array of bottom level accstruc instances
     blas = bvhList;
     blasCount = N;
+    // nesting depth from the instances' own TLASes, built or not, so that a
+    // bvhInstance of this TLAS can check it before the first build
+    for (int i = 0; i < N; i++)
+        if (blas[i].tl) level = max(level, blas[i].tl->level + 1);
     // allocate TLAS nodes
     tlasNode = (TLASNode*)_aligned_malloc(sizeof(TLASNode) * 2 * N, 64);
     nodesUsed = 2;
 }
 
+tlas::~tlas()
+{
+    _aligned_free(tlasNode);
+    delete[] parentIdx;
+    delete[] pendingChildren;
+    delete[] dirtyNode;
+}
+
 void tlas::build()
+{
+    Timer t;
+    if (blasCount <= agglomerativeLimit) BuildAgglomerative();
+    else BuildBinned();
+    buildTime = t.elapsed() * 1000;
+    LinkParents();
+    Collapse();
+    buildCost = SAHCost();
+    dirtyInstances.assign(blasCount, 0);
+    anyDirty = false;
+}
+
+void tlas::SetLeaf(uint nodeIdx, uint instance)
+{
+    tlasNode[nodeIdx].aabbMin = blas[instance].bounds.bmin;
+    tlasNode[nodeIdx].aabbMax = blas[instance].bounds.bmax;
+    tlasNode[nodeIdx].BLAS = instance;
+    tlasNode[nodeIdx].left = 0; // makes it a leaf
+}
+
+void tlas::BuildAgglomerative()
 {
     // assign a TLASleaf node to each BLAS
-    int nodeIdx[256], nodeIndices = blasCount;
+    vector<int> nodeIdx(blasCount);
+    int nodeIndices = blasCount;
     nodesUsed = 1;
     for (uint i = 0; i < blasCount; i++)
     {
         nodeIdx[i] = nodesUsed;
-        tlasNode[nodesUsed].aabbMin = blas[i].bounds.bmin;
-        tlasNode[nodesUsed].aabbMax = blas[i].bounds.bmax;
-        tlasNode[nodesUsed].BLAS = i;
-        tlasNode[nodesUsed++].leftRight = 0; // makes it a leaf
+        SetLeaf(nodesUsed++, i);
     }
+    if (blasCount == 1) { tlasNode[0] = tlasNode[1]; return; }
 
     // use agglomerative clustering to build the TLAS
-    int A = 0, B = FindBestMatch(nodeIdx, nodeIndices, A);
+    int A = 0, B = FindBestMatch(nodeIdx.data(), nodeIndices, A);
     while (nodeIndices > 1)
     {
-        int C = FindBestMatch(nodeIdx, nodeIndices, B);
+        int C = FindBestMatch(nodeIdx.data(), nodeIndices, B);
         if (A == C)
         {
             int nodeIdxA = nodeIdx[A], nodeIdxB = nodeIdx[B];
             TLASNode& nodeA = tlasNode[nodeIdxA];
             TLASNode& nodeB = tlasNode[nodeIdxB];
             TLASNode& newNode = tlasNode[nodesUsed];
-            newNode.leftRight = nodeIdxA + (nodeIdxB << 16);
+            newNode.left = nodeIdxA;
+            newNode.right = nodeIdxB;
             newNode.aabbMin = fminf(nodeA.aabbMin, nodeB.aabbMin);
             newNode.aabbMax = fmaxf(nodeA.aabbMax, nodeB.aabbMax);
             nodeIdx[A] = nodesUsed++;
             nodeIdx[B] = nodeIdx[nodeIndices - 1];
-            B = FindBestMatch(nodeIdx, --nodeIndices, A);
+            B = FindBestMatch(nodeIdx.data(), --nodeIndices, A);
         }
         else A = B, B = C;
     }
     tlasNode[0] = tlasNode[nodeIdx[A]];
 }
 
+void tlas::BuildBinned()
+{
+    // top-down binned SAH over instance centroids. OpenMP 2.0 has no tasks:
+    // the top of the tree is split serially until there are enough subtrees
+    // to keep every thread busy, which are then built by a parallel for.
+    // Nodes are claimed from an atomic counter.
+    instIdx = new uint[blasCount];
+    centroid = new float3[blasCount];
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)blasCount; i++)
+    {
+        instIdx[i] = i;
+        centroid[i] = (blas[i].bounds.bmin + blas[i].bounds.bmax) * 0.5f;
+    }
+    nodeCounter = 1;
+    struct Subtree { uint nodeIdx, first, count; };
+    vector<Subtree> subtrees = { { 0, 0, blasCount } };
+    while (subtrees.size() < 64)
+    {
+        // split the largest pending subtree, as long as it is worth a thread
+        uint largest = 0;
+        for (uint i = 1; i < subtrees.size(); i++)
+            if (subtrees[i].count > subtrees[largest].count) largest = i;
+        Subtree s = subtrees[largest];
+        if (s.count <= 4096) break;
+        uint leftCount = SplitBinned(s.nodeIdx, s.first, s.count);
+        const TLASNode& node = tlasNode[s.nodeIdx];
+        subtrees[largest] = { node.left, s.first, leftCount };
+        subtrees.push_back({ node.right, s.first + leftCount, s.count - leftCount });
+    }
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)subtrees.size(); i++)
+        SubdivideBinned(subtrees[i].nodeIdx, subtrees[i].first, subtrees[i].count);
+    nodesUsed = nodeCounter;
+    delete[] instIdx;
+    delete[] centroid;
+    instIdx = nullptr;
+    centroid = nullptr;
+}
+
+uint tlas::SplitBinned(uint nodeIdx, uint first, uint count)
+{
+    // bounds the node and partitions its instances over two new children;
+    // returns the left child's instance count, 0 for a leaf
+    TLASNode& node = tlasNode[nodeIdx];
+    if (count == 1) { SetLeaf(nodeIdx, instIdx[first]); return 0; }
+    // node bounds and centroid bounds
+    Tmpl8::aabb box, cbox;
+    for (uint i = 0; i < count; i++)
+    {
+        box.grow(blas[instIdx[first + i]].bounds);
+        cbox.grow(centroid[instIdx[first + i]]);
+    }
+    node.aabbMin = box.bmin;
+    node.aabbMax = box.bmax;
+    // find the best split over all three axes
+    const int BINS = 16;
+    int bestAxis = -1, bestSplit = 0;
+    float bestCost = 1e30f;
+    for (int a = 0; a < 3; a++)
+    {
+        float boundsMin = cbox.bmin[a], boundsMax = cbox.bmax[a];
+        if (boundsMin == boundsMax) continue;
+        Tmpl8::Bin bin[BINS];
+        float scale = BINS / (boundsMax - boundsMin);
+        for (uint i = 0; i < count; i++)
+        {
+            uint inst = instIdx[first + i];
+            int binIdx = min(BINS - 1, (int)((centroid[inst][a] - boundsMin) * scale));
+            bin[binIdx].primCount++;
+            bin[binIdx].bounds.grow(blas[inst].bounds);
+        }
+        float leftArea[BINS - 1], rightArea[BINS - 1];
+        int leftCount[BINS - 1], rightCount[BINS - 1];
+        Tmpl8::aabb leftBox, rightBox;
+        int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            leftSum += bin[i].primCount;
+            leftCount[i] = leftSum;
+            leftBox.grow(bin[i].bounds);
+            leftArea[i] = leftBox.area();
+            rightSum += bin[BINS - 1 - i].primCount;
+            rightCount[BINS - 2 - i] = rightSum;
+            rightBox.grow(bin[BINS - 1 - i].bounds);
+            rightArea[BINS - 2 - i] = rightBox.area();
+        }
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+            float planeCost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (planeCost < bestCost) bestAxis = a, bestSplit = i, bestCost = planeCost;
+        }
+    }
+    // partition; coincident centroids fall back to an even split
+    uint leftCount = count / 2;
+    if (bestAxis != -1)
+    {
+        float scale = BINS / (cbox.bmax[bestAxis] - cbox.bmin[bestAxis]);
+        int i = first, j = first + count - 1;
+        while (i <= j)
+        {
+            int binIdx = min(BINS - 1, (int)((centroid[instIdx[i]][bestAxis] - cbox.bmin[bestAxis]) * scale));
+            if (binIdx <= bestSplit) i++; else swap(instIdx[i], instIdx[j--]);
+        }
+        leftCount = i - first;
+    }
+    uint leftIdx = nodeCounter.fetch_add(2);
+    node.left = leftIdx;
+    node.right = leftIdx + 1;
+    return leftCount;
+}
+
+void tlas::SubdivideBinned(uint nodeIdx, uint first, uint count)
+{
+    uint leftCount = SplitBinned(nodeIdx, first, count);
+    if (leftCount == 0) return;
+    const TLASNode& node = tlasNode[nodeIdx];
+    SubdivideBinned(node.left, first, leftCount);
+    SubdivideBinned(node.right, first + leftCount, count - leftCount);
+}
+
+void tlas::LinkParents()
+{
+    delete[] parentIdx;
+    delete[] pendingChildren;
+    delete[] dirtyNode;
+    parentIdx = new uint[nodesUsed];
+    pendingChildren = new atomic<int>[nodesUsed];
+    dirtyNode = new atomic<char>[nodesUsed];
+    leafNodes.clear();
+    vector<uint> stack = { 0 };
+    parentIdx[0] = 0;
+    while (!stack.empty())
+    {
+        uint nodeIdx = stack.back();
+        stack.pop_back();
+        pendingChildren[nodeIdx] = 0;
+        dirtyNode[nodeIdx] = 0;
+        TLASNode& node = tlasNode[nodeIdx];
+        if (node.isLeaf()) { leafNodes.push_back(nodeIdx); continue; }
+        parentIdx[node.left] = parentIdx[node.right] = nodeIdx;
+        stack.push_back(node.left);
+        stack.push_back(node.right);
+    }
+}
+
+void tlas::Refit(const uchar* dirtyInstances)
+{
+    // same scheme as bvh::Refit: flag dirty leaves and their ancestors,
+    // then let the last arriving child refit each parent
+    const int leafCount = (int)leafNodes.size();
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < leafCount; i++)
+    {
+        uint nodeIdx = leafNodes[i];
+        if (dirtyInstances && !dirtyInstances[tlasNode[nodeIdx].BLAS]) continue;
+        while (!dirtyNode[nodeIdx].exchange(1) && nodeIdx != 0)
+        {
+            nodeIdx = parentIdx[nodeIdx];
+            pendingChildren[nodeIdx]++;
+        }
+    }
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < leafCount; i++)
+    {
+        uint nodeIdx = leafNodes[i];
+        if (!dirtyNode[nodeIdx]) continue;
+        TLASNode& leaf = tlasNode[nodeIdx];
+        leaf.aabbMin = blas[leaf.BLAS].bounds.bmin;
+        leaf.aabbMax = blas[leaf.BLAS].bounds.bmax;
+        dirtyNode[nodeIdx] = 0;
+        while (nodeIdx != 0)
+        {
+            nodeIdx = parentIdx[nodeIdx];
+            if (--pendingChildren[nodeIdx] > 0) break;
+            TLASNode& node = tlasNode[nodeIdx];
+            TLASNode& left = tlasNode[node.left];
+            TLASNode& right = tlasNode[node.right];
+            node.aabbMin = fminf(left.aabbMin, right.aabbMin);
+            node.aabbMax = fmaxf(left.aabbMax, right.aabbMax);
+            dirtyNode[nodeIdx] = 0;
+        }
+    }
+    RefitNode4();
+}
+
+void tlas::SetTransforms(const uint* instances, const mat4* transforms, uint count)
+{
+    // new world bounds per instance; the tree is brought up to date in Update
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)count; i++)
+    {
+        blas[instances[i]].SetTransform(transforms[i]);
+        dirtyInstances[instances[i]] = 1;
+    }
+    if (count > 0) anyDirty = true;
+}
+
+void tlas::Update()
+{
+    // small motion: refit the moved leaves. Once the refitted tree costs
+    // noticeably more than a fresh one would, rebuild it from scratch.
+    if (!anyDirty) return;
+    Refit(dirtyInstances.data());
+    if (SAHCost() > rebuildThreshold * buildCost) build();
+    else dirtyInstances.assign(blasCount, 0);
+    anyDirty = false;
+}
+
+float tlas::SAHCost()
+{
+    // same measure as bvh::SAHCost: node areas relative to the root,
+    // leaves weighted by one instance each
+    float3 e = tlasNode[0].aabbMax - tlasNode[0].aabbMin;
+    float rootArea = e.x * e.y + e.y * e.z + e.z * e.x;
+    if (!(rootArea > 0)) rootArea = 1;
+    float cost = 0;
+    // walk the linked tree rather than the node array: the agglomerative
+    // builder leaves the root's original slot orphaned
+#pragma omp parallel for reduction(+:cost) schedule(static)
+    for (int i = 0; i < (int)leafNodes.size(); i++)
+    {
+        uint nodeIdx = leafNodes[i];
+        TLASNode& leaf = tlasNode[nodeIdx];
+        float3 n = leaf.aabbMax - leaf.aabbMin;
+        cost += n.x * n.y + n.y * n.z + n.z * n.x;
+        // every interior node is charged once, by the left child's first leaf
+        while (nodeIdx != 0)
+        {
+            uint parent = parentIdx[nodeIdx];
+            if (tlasNode[parent].left != nodeIdx) break;
+            TLASNode& node = tlasNode[parent];
+            float3 m = node.aabbMax - node.aabbMin;
+            cost += m.x * m.y + m.y * m.z + m.z * m.x;
+            nodeIdx = parent;
+        }
+    }
+    return cost / rootArea;
+}
+
 int tlas::FindBestMatch(int* list, int N, int A)
 {
     float smallest = 1e30f;
@@ -62,61 +336,226 @@ int tlas::FindBestMatch(int* list, int N, int A)
     return bestB;
 }
 
-void tlas::Intersect(Ray& ray)
+float tlas::NodeArea(uint nodeIdx)
 {
-    TLASNode* node = &tlasNode[0], * stack[64];
-    uint stackPtr = 0;
-    while (1)
+    float3 e = tlasNode[nodeIdx].aabbMax - tlasNode[nodeIdx].aabbMin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void tlas::Collapse()
+{
+    // a 4-wide node replaces at most three binary interior nodes
+    tlasNode4.clear();
+    tlasNode4.reserve(blasCount);
+    node4Source.clear();
+    node4Source.reserve(blasCount * 4);
+    Collapse(0);
+}
+
+void tlas::RefitNode4()
+{
+    // a refit keeps the binary topology, so every 4-wide node takes its
+    // children's new bounds from the binary nodes it was collapsed from
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < (int)tlasNode4.size(); i++)
+    {
+        TLASNode4& node4 = tlasNode4[i];
+        float bmin[3][4], bmax[3][4];
+        for (uint k = 0; k < 4; k++)
+        {
+            if (k >= node4.count)
+            {
+                for (int a = 0; a < 3; a++) bmin[a][k] = 1e30f, bmax[a][k] = -1e30f;
+                continue;
+            }
+            TLASNode& n = tlasNode[node4Source[i * 4 + k]];
+            for (int a = 0; a < 3; a++) bmin[a][k] = n.aabbMin[a], bmax[a][k] = n.aabbMax[a];
+        }
+        node4.bminX = _mm_loadu_ps(bmin[0]), node4.bminY = _mm_loadu_ps(bmin[1]), node4.bminZ = _mm_loadu_ps(bmin[2]);
+        node4.bmaxX = _mm_loadu_ps(bmax[0]), node4.bmaxY = _mm_loadu_ps(bmax[1]), node4.bmaxZ = _mm_loadu_ps(bmax[2]);
+    }
+}
+
+uint tlas::Collapse(uint nodeIdx)
+{
+    const uint node4Idx = (uint)tlasNode4.size();
+    tlasNode4.emplace_back();
+    node4Source.resize(node4Source.size() + 4);
+    // gather up to four subtrees, opening the largest interior one first
+    uint slot[4], count = 0;
+    if (tlasNode[nodeIdx].isLeaf()) slot[count++] = nodeIdx;
+    else slot[count++] = tlasNode[nodeIdx].left, slot[count++] = tlasNode[nodeIdx].right;
+    while (count < 4)
+    {
+        int open = -1;
+        float openArea = -1;
+        for (uint i = 0; i < count; i++)
+            if (!tlasNode[slot[i]].isLeaf() && NodeArea(slot[i]) > openArea) open = i, openArea = NodeArea(slot[i]);
+        if (open == -1) break;
+        uint n = slot[open];
+        slot[open] = tlasNode[n].left;
+        slot[count++] = tlasNode[n].right;
+    }
+    float bmin[3][4], bmax[3][4];
+    uint child[4] = { 0, 0, 0, 0 };
+    for (uint i = 0; i < 4; i++)
     {
-        if (node->isLeaf())
+        if (i >= count)
         {
-            blas[node->BLAS].BIntersect(ray);
-            if (stackPtr == 0) break; else node = stack[--stackPtr];
+            for (int a = 0; a < 3; a++) bmin[a][i] = 1e30f, bmax[a][i] = -1e30f;
             continue;
         }
-        TLASNode* child1 = &tlasNode[node->leftRight & 0x0000FFFF];
-        TLASNode* child2 = &tlasNode[node->leftRight >> 16];
-        float dist1 = bvh::IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
-        float dist2 = bvh::IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
-        if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
-        if (dist1 == 1e30f)
+        TLASNode& n = tlasNode[slot[i]];
+        for (int a = 0; a < 3; a++) bmin[a][i] = n.aabbMin[a], bmax[a][i] = n.aabbMax[a];
+        child[i] = n.isLeaf() ? (n.BLAS | TLAS4_LEAF) : Collapse(slot[i]);
+    }
+    // fill in after recursing: emplace_back may have moved the array
+    TLASNode4& node4 = tlasNode4[node4Idx];
+    node4.bminX = _mm_loadu_ps(bmin[0]), node4.bminY = _mm_loadu_ps(bmin[1]), node4.bminZ = _mm_loadu_ps(bmin[2]);
+    node4.bmaxX = _mm_loadu_ps(bmax[0]), node4.bmaxY = _mm_loadu_ps(bmax[1]), node4.bmaxZ = _mm_loadu_ps(bmax[2]);
+    for (uint i = 0; i < 4; i++) node4.child[i] = child[i], node4Source[node4Idx * 4 + i] = i < count ? slot[i] : 0;
+    node4.count = count;
+    return node4Idx;
+}
+
+// slab test against the four children of a node; returns the hit mask and
+// writes the entry distances
+static inline int IntersectTLASNode4(const TLASNode4& node, const __m128 O[3], const __m128 rD[3], const __m128 t4, float* tEntry)
+{
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(node.bminX, O[0]), rD[0]);
+    __m128 tx2 = _mm_mul_ps(_mm_sub_ps(node.bmaxX, O[0]), rD[0]);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(node.bminY, O[1]), rD[1]);
+    __m128 ty2 = _mm_mul_ps(_mm_sub_ps(node.bmaxY, O[1]), rD[1]);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(node.bminZ, O[2]), rD[2]);
+    __m128 tz2 = _mm_mul_ps(_mm_sub_ps(node.bmaxZ, O[2]), rD[2]);
+    __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+    __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+    __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, t4)), _mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+    _mm_storeu_ps(tEntry, tmin);
+    return _mm_movemask_ps(hit) & ((1 << node.count) - 1);
+}
+
+struct TLASStackEntry { uint child; float dist; };
+
+void tlas::Intersect(Ray& ray, TraversalMode mode)
+{
+    // planes first, as in bvh::Intersect: a near plane hit shortens the ray
+    planes.Intersect(ray, 0.0001f);
+    if (mode == TRAVERSE_STACKLESS) { StacklessIntersect(ray); return; }
+    const __m128 O[3] = { _mm_set1_ps(ray.O.x), _mm_set1_ps(ray.O.y), _mm_set1_ps(ray.O.z) };
+    const __m128 rD[3] = { _mm_set1_ps(ray.rD.x), _mm_set1_ps(ray.rD.y), _mm_set1_ps(ray.rD.z) };
+    TLASStackEntry stack[TLAS_STACK_SIZE];
+    uint stackPtr = 0;
+    stack[stackPtr++] = { 0, 0 };
+    while (stackPtr > 0)
+    {
+        TLASStackEntry e = stack[--stackPtr];
+        // a closer hit was found after this entry was pushed
+        if (e.dist >= ray.t) continue;
+        if (e.child & TLAS4_LEAF)
         {
-            if (stackPtr == 0) break; else node = stack[--stackPtr];
+            blas[e.child & ~TLAS4_LEAF].BIntersect(ray);
+            continue;
         }
-        else
+        // no room for four more entries: finish this ray without a stack
+        if (stackPtr > TLAS_STACK_SIZE - 4) { StacklessIntersect(ray); return; }
+        const TLASNode4& node = tlasNode4[e.child];
+        float tEntry[4];
+        int mask = IntersectTLASNode4(node, O, rD, _mm_set1_ps(ray.t), tEntry);
+        // push far to near, so the nearest child is visited first
+        uint order[4], hits = 0;
+        for (uint i = 0; i < 4; i++) if (mask & (1 << i))
         {
-            node = child1;
-            if (dist2 != 1e30f) stack[stackPtr++] = child2;
+            uint j = hits++;
+            while (j > 0 && tEntry[order[j - 1]] < tEntry[i]) order[j] = order[j - 1], j--;
+            order[j] = i;
         }
+        for (uint i = 0; i < hits; i++) stack[stackPtr++] = { node.child[order[i]], tEntry[order[i]] };
     }
 }
 
-bool tlas::IsOccluded(Ray& ray)
+bool tlas::IsOccluded(Ray& ray, TraversalMode mode)
 {
-    TLASNode* node = &tlasNode[0], * stack[64];
-    uint stackPtr = 0;
-    while (1)
+    if (planes.IsOccluding(ray, 0.0001f)) return true;
+    if (mode == TRAVERSE_STACKLESS) return StacklessIsOccluded(ray);
+    // any hit ends the query, so children are visited in storage order
+    const __m128 O[3] = { _mm_set1_ps(ray.O.x), _mm_set1_ps(ray.O.y), _mm_set1_ps(ray.O.z) };
+    const __m128 rD[3] = { _mm_set1_ps(ray.rD.x), _mm_set1_ps(ray.rD.y), _mm_set1_ps(ray.rD.z) };
+    const __m128 t4 = _mm_set1_ps(ray.t);
+    uint stack[TLAS_STACK_SIZE], stackPtr = 0;
+    stack[stackPtr++] = 0;
+    while (stackPtr > 0)
     {
-        if (node->isLeaf())
+        uint child = stack[--stackPtr];
+        if (child & TLAS4_LEAF)
         {
-            if(blas[node->BLAS].IsOccluded(ray)) return true;
-            if (stackPtr == 0) break; else node = stack[--stackPtr];
+            if (blas[child & ~TLAS4_LEAF].IsOccluded(ray)) return true;
             continue;
         }
-        TLASNode* child1 = &tlasNode[node->leftRight & 0x0000FFFF];
-        TLASNode* child2 = &tlasNode[node->leftRight >> 16];
-        float dist1 = bvh::IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
-        float dist2 = bvh::IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
-        if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
-        if (dist1 == 1e30f)
+        if (stackPtr > TLAS_STACK_SIZE - 4) return StacklessIsOccluded(ray);
+        const TLASNode4& node = tlasNode4[child];
+        float tEntry[4];
+        int mask = IntersectTLASNode4(node, O, rD, t4, tEntry);
+        for (uint i = 0; i < 4; i++) if (mask & (1 << i)) stack[stackPtr++] = node.child[i];
+    }
+    return false;
+}
+
+static inline bool IntersectTLASNode(const TLASNode& node, const Ray& ray)
+{
+    float tx1 = (node.aabbMin.x - ray.O.x) * ray.rD.x, tx2 = (node.aabbMax.x - ray.O.x) * ray.rD.x;
+    float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+    float ty1 = (node.aabbMin.y - ray.O.y) * ray.rD.y, ty2 = (node.aabbMax.y - ray.O.y) * ray.rD.y;
+    tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+    float tz1 = (node.aabbMin.z - ray.O.z) * ray.rD.z, tz2 = (node.aabbMax.z - ray.O.z) * ray.rD.z;
+    tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+    return tmax >= tmin && tmin < ray.t && tmax > 0;
+}
+
+// next node after finishing nodeIdx's subtree: the right sibling when
+// coming from the left, otherwise climb; 0 (the root) when done
+uint tlas::NextNode(uint nodeIdx)
+{
+    while (nodeIdx != 0)
+    {
+        uint parent = parentIdx[nodeIdx];
+        if (tlasNode[parent].left == nodeIdx) return tlasNode[parent].right;
+        nodeIdx = parent;
+    }
+    return 0;
+}
+
+// stackless traversal of the binary tree via parent links; the only
+// per-ray state is the current node
+void tlas::StacklessIntersect(Ray& ray)
+{
+    if (tlasNode[0].isLeaf()) { blas[tlasNode[0].BLAS].BIntersect(ray, TRAVERSE_STACKLESS); return; }
+    uint nodeIdx = tlasNode[0].left;
+    while (nodeIdx != 0)
+    {
+        TLASNode& node = tlasNode[nodeIdx];
+        if (IntersectTLASNode(node, ray))
         {
-            if (stackPtr == 0) break; else node = stack[--stackPtr];
+            if (!node.isLeaf()) { nodeIdx = node.left; continue; }
+            blas[node.BLAS].BIntersect(ray, TRAVERSE_STACKLESS);
         }
-        else
+        nodeIdx = NextNode(nodeIdx);
+    }
+}
+
+bool tlas::StacklessIsOccluded(Ray& ray)
+{
+    if (tlasNode[0].isLeaf()) return blas[tlasNode[0].BLAS].IsOccluded(ray, TRAVERSE_STACKLESS);
+    uint nodeIdx = tlasNode[0].left;
+    while (nodeIdx != 0)
+    {
+        TLASNode& node = tlasNode[nodeIdx];
+        if (IntersectTLASNode(node, ray))
         {
-            node = child1;
-            if (dist2 != 1e30f) stack[stackPtr++] = child2;
+            if (!node.isLeaf()) { nodeIdx = node.left; continue; }
+            if (blas[node.BLAS].IsOccluded(ray, TRAVERSE_STACKLESS)) return true;
         }
+        nodeIdx = NextNode(nodeIdx);
     }
     return false;
-}
\ No newline at end of file
+}
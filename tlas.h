@@ -4,26 +4,78 @@
 struct TLASNode
 {
     float3 aabbMin;
-    uint leftRight; // 2x16 bits
+    uint left; // 0 for leaves: node 0 is the root, never a child
     float3 aabbMax;
-    uint BLAS;
-    bool isLeaf() { return leftRight == 0; }
+    union { uint right; uint BLAS; };
+    bool isLeaf() { return left == 0; }
 };
 
+// 4-wide node used for traversal, collapsed from the binary tree. Child
+// bounds are stored per axis so one SSE slab test covers all four.
+struct TLASNode4
+{
+    __m128 bminX, bminY, bminZ;
+    __m128 bmaxX, bmaxY, bmaxZ;
+    uint child[4]; // node index, or instance index | TLAS4_LEAF
+    uint count;
+};
+#define TLAS4_LEAF 0x80000000
+#define TLAS_STACK_SIZE 256 // deeper paths finish in stackless mode
+#define MAX_INSTANCE_LEVELS 4 // TLASes instanced inside TLASes, see bvhInstance
+
 class tlas
 {
 public:
     tlas(bvhInstance* bvhList, int N);
+    ~tlas();
 
-    void tlas::build();
-    int tlas::FindBestMatch(int* list, int N, int A);
-    void Intersect(Ray& ray);
-    bool IsOccluded(Ray& ray);
+    void build();
+    int FindBestMatch(int* list, int N, int A);
+    void LinkParents();
+    void Refit(const uchar* dirtyInstances = nullptr);
+    void SetTransforms(const uint* instances, const mat4* transforms, uint count);
+    void Update();
+    float SAHCost();
+    void Intersect(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
+    bool IsOccluded(Ray& ray, TraversalMode mode = TRAVERSE_STACK);
+private:
+    void BuildAgglomerative();
+    void BuildBinned();
+    uint SplitBinned(uint nodeIdx, uint first, uint count);
+    void SubdivideBinned(uint nodeIdx, uint first, uint count);
+    void SetLeaf(uint nodeIdx, uint instance);
+    void Collapse();
+    uint Collapse(uint nodeIdx);
+    void RefitNode4();
+    float NodeArea(uint nodeIdx);
+    void StacklessIntersect(Ray& ray);
+    bool StacklessIsOccluded(Ray& ray);
+    uint NextNode(uint nodeIdx);
 public:
     TLASNode* tlasNode;
     uint nodesUsed = 0;
     bvhInstance* blas;
     uint blasCount;
+    uint level = 1; // 1 + deepest nested TLAS among the instances
+    Tmpl8::PlaneList planes; // the scene's planes, top level only: unbounded, so outside the tree
+    // refit bookkeeping, see LinkParents
+    uint* parentIdx = nullptr;
+    atomic<int>* pendingChildren = nullptr;
+    atomic<char>* dirtyNode = nullptr;
+    vector<uint> leafNodes;
+    vector<TLASNode4> tlasNode4; // traversal nodes, root at 0
+    vector<uint> node4Source; // per tlasNode4 child: the binary node it came from, see RefitNode4
+    // binned builder scratch: instance order and centroids
+    uint* instIdx = nullptr;
+    float3* centroid = nullptr;
+    atomic<uint> nodeCounter;
+    uint agglomerativeLimit = 256; // exact clustering below this instance count
+    // dynamic instances, see Update
+    vector<uchar> dirtyInstances;
+    bool anyDirty = false;
+    float buildCost = 0;
+    float buildTime = 0; // ms, of the last build; Update may rebuild every frame, so it is not printed
+    float rebuildThreshold = 1.5f; // rebuild once refits degrade SAH cost by 50%
 
     
 };